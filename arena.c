@@ -0,0 +1,76 @@
+#include "arena.h"
+#include "defines.h"
+#include "memstats.h"
+#include "node.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+// Goal: an arena of Nodes, so a whole Huffman tree is one contiguous array
+// instead of a malloc per Node. A Huffman tree of ALPHABET symbols has at most
+// MAX_NODES nodes, so an arena always has room for one tree. The Nodes are
+// handed out in order, and all of them are freed at once by resetting the
+// arena, instead of going through the tree. Nodes from an arena must never be
+// passed to node_delete or delete_tree (and a Stack or PriorityQueue that
+// holds them must be emptied before it is deleted).
+
+// Defines what members/fields the Arena structure has.
+// Size is the number of Nodes handed out, and nodes holds all the Nodes.
+struct Arena {
+  uint32_t size;
+  Node nodes[MAX_NODES];
+};
+
+// The constructor for an Arena. Returns a pointer to the Arena if the memory
+// was allocated succesfully. Else, return NULL.
+Arena *arena_create(void) {
+  Arena *a = (Arena *)malloc(sizeof(Arena));
+  if (a) {
+    a->size = 0;
+  }
+  return a;
+}
+
+// The destructor for an Arena. Frees the Arena with all of its Nodes, and set
+// the pointer to NULL.
+void arena_delete(Arena **a) {
+  if (*a) {
+    free(*a);
+    *a = NULL;
+  }
+}
+
+// Frees all the Nodes of the arena at once, so it can hold a new tree.
+void arena_reset(Arena *a) { a->size = 0; }
+
+// Returns the number of Nodes handed out since the last reset.
+uint32_t arena_size(Arena *a) { return a->size; }
+
+// Hands out a Node of the arena with the given symbol and frequency, like
+// node_create. Returns NULL if the arena is full.
+Node *arena_node(Arena *a, uint8_t symbol, uint64_t frequency) {
+  if (a->size == MAX_NODES) {
+    return NULL;
+  }
+  Node *n = &a->nodes[a->size];
+  a->size += 1;
+  n->symbol = symbol;
+  n->frequency = frequency;
+  n->left = NULL;
+  n->right = NULL;
+  return n;
+}
+
+// Joins a left child node and a right child node under a new Node of the
+// arena, like node_join. Returns the parent, or NULL if a child is NULL or the
+// arena is full.
+Node *arena_join(Arena *a, Node *left, Node *right) {
+  if (!left || !right) {
+    return NULL;
+  }
+  Node *parent = arena_node(a, '$', left->frequency + right->frequency);
+  if (parent) {
+    parent->left = left;
+    parent->right = right;
+  }
+  return parent;
+}
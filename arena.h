@@ -0,0 +1,18 @@
+#pragma once
+
+#include "node.h"
+#include <stdint.h>
+
+typedef struct Arena Arena;
+
+Arena *arena_create(void);
+
+void arena_delete(Arena **a);
+
+void arena_reset(Arena *a);
+
+uint32_t arena_size(Arena *a);
+
+Node *arena_node(Arena *a, uint8_t symbol, uint64_t frequency);
+
+Node *arena_join(Arena *a, Node *left, Node *right);
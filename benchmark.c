@@ -0,0 +1,532 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Goal: measure the encoder and the decoder the same way every time. Each
+// corpus is generated from a fixed seed (or built from the repo's own
+// executables), written to a work directory, and then ./encode and ./decode
+// are run on it several times as separate processes. Every run is timed with
+// a monotonic clock, and the peak RSS of the process is taken from wait4. The
+// decoded file must match the corpus. The results are printed as CSV or JSON:
+// one row per corpus and program, with the ratio, the min, median and
+// standard deviation of the run times, the MB/s of the fastest and median run
+// and the largest peak RSS.
+
+#define MB (1 << 20)        // Bytes per MB.
+#define MAX_RUNS 1000       // Most runs of each program.
+#define MAX_ARGS 32         // Most extra options of a program.
+#define SEED 0x9E3779B97F4A7C15ULL // Seed of the generators.
+
+// Returns the next number of the xorshift64* generator with the given state.
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545F4914F6CDD1DULL;
+}
+
+// Fills the n bytes of buf with uniformly random bytes.
+static bool random_corpus(uint8_t *buf, uint64_t n, uint64_t *state) {
+  for (uint64_t i = 0; i < n; i += 8) {
+    uint64_t r = next_random(state);
+    memcpy(&buf[i], &r, n - i < 8 ? n - i : 8);
+  }
+  return true;
+}
+
+// Fills the n bytes of buf with English-like text: sentences of common words,
+// where the k-th most common word is picked with a weight of 1 / k, as in
+// real text (Zipf's law), split into paragraphs.
+static bool text_corpus(uint8_t *buf, uint64_t n, uint64_t *state) {
+  static const char *words[] = {
+      "the",    "of",    "and",   "to",     "a",      "in",     "is",
+      "it",     "you",   "that",  "he",     "was",    "for",    "on",
+      "are",    "with",  "as",    "his",    "they",   "be",     "at",
+      "one",    "have",  "this",  "from",   "or",     "had",    "by",
+      "hot",    "word",  "but",   "what",   "some",   "we",     "can",
+      "out",    "other", "were",  "all",    "there",  "when",   "up",
+      "use",    "your",  "how",   "said",   "an",     "each",   "she",
+      "which",  "do",    "their", "time",   "if",     "will",   "way",
+      "about",  "many",  "then",  "them",   "write",  "would",  "like",
+      "so",     "these", "her",   "long",   "make",   "thing",  "see",
+      "him",    "two",   "has",   "look",   "more",   "day",    "could",
+      "go",     "come",  "did",   "number", "sound",  "no",     "most",
+      "people", "my",    "over",  "know",   "water",  "than",   "call",
+      "first",  "who",   "may",   "down",   "side",   "been",   "now",
+      "find",   "any",   "new",   "work",   "part",   "take",   "get",
+      "place",  "made",  "live",  "where",  "after",  "back",   "little",
+      "only",   "round", "man",   "year",   "came",   "show",   "every",
+      "good",   "me",    "give",  "our",    "under",  "name",   "very",
+      "through", "just", "form",  "sentence", "great", "think", "say",
+      "help",   "low",   "line",  "differ", "turn",   "cause",  "much",
+      "mean",   "before", "move", "right",  "boy",    "old",    "too",
+      "same",   "tell",  "does",  "set",    "three",  "want",   "air",
+      "well",   "also",  "play",  "small",  "end",    "put",    "home",
+      "read",   "hand",  "port",  "large",  "spell",  "add",    "even",
+      "land",   "here",  "must",  "big",    "high",   "such",   "follow",
+      "act",    "why",   "ask",   "men",    "change", "went",   "light",
+      "kind",   "off",   "need",  "house",  "picture", "try",   "us",
+      "again",  "animal", "point", "mother", "world", "near",   "build",
+      "self",   "earth", "father", "head",  "stand",  "own",    "page",
+      "should", "country", "found", "answer", "school", "grow", "study"};
+  uint64_t count = sizeof(words) / sizeof(words[0]);
+  // The running sums of the weights, to pick a word with one binary search
+  double sums[sizeof(words) / sizeof(words[0])];
+  double total = 0;
+  for (uint64_t k = 0; k < count; k += 1) {
+    total += 1.0 / (k + 1);
+    sums[k] = total;
+  }
+  uint64_t i = 0;
+  uint64_t sentence = 0;
+  while (i < n) {
+    uint64_t length = 4 + next_random(state) % 13;
+    for (uint64_t w = 0; w < length && i < n; w += 1) {
+      double r = (next_random(state) >> 11) * 0x1.0p-53 * total;
+      uint64_t low = 0;
+      uint64_t high = count - 1;
+      while (low < high) {
+        uint64_t mid = (low + high) / 2;
+        if (sums[mid] < r) {
+          low = mid + 1;
+        } else {
+          high = mid;
+        }
+      }
+      const char *word = words[low];
+      for (uint64_t c = 0; word[c] != '\0' && i < n; c += 1) {
+        buf[i] = c == 0 && w == 0 ? word[c] - 'a' + 'A' : word[c];
+        i += 1;
+      }
+      // Words are separated by spaces, with a comma now and then
+      if (w + 1 < length && i < n) {
+        if (next_random(state) % 12 == 0) {
+          buf[i] = ',';
+          i += 1;
+        }
+        if (i < n) {
+          buf[i] = ' ';
+          i += 1;
+        }
+      }
+    }
+    // Sentences end with a period, and every few make a paragraph
+    sentence += 1;
+    const char *end = sentence % 6 == 0 ? ".\n\n" : ". ";
+    for (uint64_t c = 0; end[c] != '\0' && i < n; c += 1) {
+      buf[i] = end[c];
+      i += 1;
+    }
+  }
+  return true;
+}
+
+// Fills the n bytes of buf with two symbols, one of them 9 times as common as
+// the other.
+static bool skewed_corpus(uint8_t *buf, uint64_t n, uint64_t *state) {
+  for (uint64_t i = 0; i < n; i += 1) {
+    buf[i] = next_random(state) % 10 == 0 ? 'b' : 'a';
+  }
+  return true;
+}
+
+// Fills the n bytes of buf with the same byte.
+static bool same_corpus(uint8_t *buf, uint64_t n, uint64_t *state) {
+  (void)state;
+  memset(buf, 'z', n);
+  return true;
+}
+
+// Fills the n bytes of buf with the lines of a JSON log of web requests.
+static bool json_corpus(uint8_t *buf, uint64_t n, uint64_t *state) {
+  static const char *levels[] = {"INFO", "INFO", "INFO", "WARN", "ERROR",
+                                 "DEBUG"};
+  static const char *methods[] = {"GET", "GET", "GET", "POST", "PUT",
+                                  "DELETE"};
+  static const char *paths[] = {"users", "orders", "items", "carts",
+                                "sessions", "search"};
+  static const uint32_t statuses[] = {200, 200, 200, 201, 204,
+                                      301, 404, 500};
+  uint64_t i = 0;
+  uint64_t ms = 0;
+  char line[512];
+  while (i < n) {
+    ms += next_random(state) % 50;
+    uint64_t id = next_random(state);
+    uint64_t r = next_random(state);
+    int length = snprintf(
+        line, sizeof(line),
+        "{\"ts\":\"2024-03-%02" PRIu64 "T%02" PRIu64 ":%02" PRIu64
+        ":%02" PRIu64 ".%03" PRIu64 "Z\",\"level\":\"%s\",\"service\":"
+        "\"api\",\"request_id\":\"%016" PRIx64 "\",\"method\":\"%s\","
+        "\"path\":\"/api/v1/%s/%" PRIu64 "\",\"status\":%u,"
+        "\"latency_ms\":%" PRIu64 ",\"bytes\":%" PRIu64 "}\n",
+        1 + ms / 86400000 % 28, ms / 3600000 % 24, ms / 60000 % 60,
+        ms / 1000 % 60, ms % 1000, levels[r % 6], id,
+        methods[(r >> 8) % 6], paths[(r >> 16) % 6], (r >> 24) % 100000,
+        statuses[(r >> 44) % 8], (r >> 48) % 2000, (r >> 32) % 65536);
+    uint64_t copy = n - i < (uint64_t)length ? n - i : (uint64_t)length;
+    memcpy(&buf[i], line, copy);
+    i += copy;
+  }
+  return true;
+}
+
+// Fills the n bytes of buf with the encode and decode executables, one after
+// the other, over and over. Returns false if they can't be read.
+static bool binary_corpus(uint8_t *buf, uint64_t n, uint64_t *state) {
+  (void)state;
+  static const char *names[] = {"encode", "decode"};
+  uint64_t i = 0;
+  bool any = false;
+  while (i < n) {
+    for (uint64_t k = 0; k < 2 && i < n; k += 1) {
+      FILE *f = fopen(names[k], "rb");
+      if (!f) {
+        continue;
+      }
+      size_t r;
+      while (i < n && (r = fread(&buf[i], 1, n - i, f)) > 0) {
+        i += r;
+        any = true;
+      }
+      fclose(f);
+    }
+    if (!any) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Defines what members/fields a corpus has.
+// Name names it and its files, and generate fills a buffer with it.
+typedef struct {
+  const char *name;
+  bool (*generate)(uint8_t *buf, uint64_t n, uint64_t *state);
+} Corpus;
+
+static const Corpus corpora[] = {
+    {"random", random_corpus}, {"text", text_corpus},
+    {"skewed", skewed_corpus}, {"same", same_corpus},
+    {"json", json_corpus},     {"binary", binary_corpus}};
+
+// Defines what members/fields the results of one program on a corpus have.
+// Times holds the seconds of each of the runs, and rss the largest peak RSS
+// of a run in KB.
+typedef struct {
+  double times[MAX_RUNS];
+  uint32_t runs;
+  long rss;
+} Result;
+
+// Runs the program with the arguments args (ending with NULL) as a child
+// process with stdout and stderr kept, and waits for it. Sets seconds to the
+// time it took and rss to its peak RSS in KB. Returns true if it exited with
+// status 0, false otherwise.
+static bool run(char **args, double *seconds, long *rss) {
+  struct timespec start;
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pid_t pid = fork();
+  if (pid < 0) {
+    return false;
+  }
+  if (pid == 0) {
+    execv(args[0], args);
+    _exit(127);
+  }
+  int status;
+  struct rusage usage;
+  while (wait4(pid, &status, 0, &usage) < 0) {
+    if (errno != EINTR) {
+      return false;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  *seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  *rss = usage.ru_maxrss;
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Splits the options in text at spaces into args, after the count arguments
+// already in it, and ends args with NULL. Returns false if there are too many.
+static bool split_options(char *text, char **args, uint32_t count) {
+  for (char *word = strtok(text, " "); word; word = strtok(NULL, " ")) {
+    if (count >= MAX_ARGS + 5) {
+      return false;
+    }
+    args[count] = word;
+    count += 1;
+  }
+  args[count] = NULL;
+  return true;
+}
+
+// Returns the size of the file at path, or 0 if there isn't one.
+static uint64_t file_size(const char *path) {
+  struct stat s;
+  return stat(path, &s) == 0 ? (uint64_t)s.st_size : 0;
+}
+
+// Returns true if the file at path holds exactly the n bytes of buf.
+static bool same_file(const char *path, uint8_t *buf, uint64_t n) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return false;
+  }
+  uint8_t block[65536];
+  uint64_t i = 0;
+  size_t r;
+  bool same = true;
+  while (same && (r = fread(block, 1, sizeof(block), f)) > 0) {
+    same = r <= n - i && memcmp(block, &buf[i], r) == 0;
+    i += r;
+  }
+  fclose(f);
+  return same && i == n;
+}
+
+// Compares two doubles for qsort.
+static int compare(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Prints the results of the program named op on the corpus named name of
+// size bytes that compressed to compressed bytes, as a CSV line or a JSON
+// object. First is set for the first result, which in JSON has no comma
+// before it.
+static void print_result(bool json, bool first, const char *name,
+                         const char *op, uint64_t size, uint64_t compressed,
+                         Result *r) {
+  double sorted[MAX_RUNS];
+  memcpy(sorted, r->times, r->runs * sizeof(double));
+  qsort(sorted, r->runs, sizeof(double), compare);
+  double min = sorted[0];
+  double median = r->runs % 2 == 1 ? sorted[r->runs / 2]
+                                   : (sorted[r->runs / 2 - 1] +
+                                      sorted[r->runs / 2]) / 2;
+  // The sample standard deviation, which is 0 for a single run
+  double mean = 0;
+  for (uint32_t i = 0; i < r->runs; i += 1) {
+    mean += r->times[i] / r->runs;
+  }
+  double squares = 0;
+  for (uint32_t i = 0; i < r->runs; i += 1) {
+    squares += (r->times[i] - mean) * (r->times[i] - mean);
+  }
+  double stddev = r->runs > 1 ? sqrt(squares / (r->runs - 1)) : 0;
+  double ratio = size == 0 ? 0 : (double)compressed / size;
+  double best = min > 0 ? (double)size / MB / min : 0;
+  double typical = median > 0 ? (double)size / MB / median : 0;
+  if (json) {
+    printf("%s  {\"corpus\": \"%s\", \"op\": \"%s\", \"bytes\": %" PRIu64
+           ", \"compressed\": %" PRIu64 ", \"ratio\": %.4f, \"runs\": %u, "
+           "\"min_s\": %.6f, \"median_s\": %.6f, \"stddev_s\": %.6f, "
+           "\"best_mb_s\": %.1f, \"median_mb_s\": %.1f, "
+           "\"peak_rss_kb\": %ld}",
+           first ? "" : ",\n", name, op, size, compressed, ratio, r->runs,
+           min, median, stddev, best, typical, r->rss);
+  } else {
+    printf("%s,%s,%" PRIu64 ",%" PRIu64 ",%.4f,%u,%.6f,%.6f,%.6f,%.1f,%.1f,"
+           "%ld\n",
+           name, op, size, compressed, ratio, r->runs, min, median, stddev,
+           best, typical, r->rss);
+  }
+}
+
+// Function to print the help message
+void print_error(void) {
+  fprintf(stderr, "SYNOPSIS\n");
+  fprintf(stderr, "  Benchmarks the encoder and the decoder on generated corpora.\n\n");
+
+  fprintf(stderr, "USAGE\n");
+  fprintf(stderr, "  ./benchmark [-h] [-n runs] [-m mb] [-f csv|json] [-w dir]\n"
+                  "             [-e options] [-d options]\n\n");
+
+  fprintf(stderr, "OPTIONS\n");
+  fprintf(stderr, "  -h             Program usage and help.\n");
+  fprintf(stderr, "  -n runs        Runs of each program on each corpus (default: 5).\n");
+  fprintf(stderr, "  -m mb          Size of each corpus in MB (default: 16).\n");
+  fprintf(stderr, "  -f format      Print the results as csv or json (default: csv).\n");
+  fprintf(stderr, "  -w dir         Directory of the corpora and outputs\n");
+  fprintf(stderr, "                 (default: bench_data).\n");
+  fprintf(stderr, "  -e options     Extra options of ./encode, such as \"-B 65536\".\n");
+  fprintf(stderr, "  -d options     Extra options of ./decode.\n");
+}
+
+int main(int argc, char **argv) {
+  int opt = 0; // used for getopt
+  // set default numbers
+  uint32_t runs = 5;
+  uint64_t size = 16;
+  bool json = false;
+  char *dir = "bench_data";
+  char *encode_options = "";
+  char *decode_options = "";
+
+  while ((opt = getopt(argc, argv, "hn:m:f:w:e:d:")) != -1) {
+    switch (opt) {
+    // sets the number of runs of each program on each corpus
+    case 'n':
+      runs = strtoul(optarg, NULL, 10);
+      if (runs == 0 || runs > MAX_RUNS) {
+        print_error();
+        return 1;
+      }
+      break;
+    // sets the size of each corpus in MB
+    case 'm':
+      size = strtoull(optarg, NULL, 10);
+      if (size == 0 || size > 4096) {
+        print_error();
+        return 1;
+      }
+      break;
+    // sets the format of the results
+    case 'f':
+      if (strcmp(optarg, "csv") != 0 && strcmp(optarg, "json") != 0) {
+        print_error();
+        return 1;
+      }
+      json = strcmp(optarg, "json") == 0;
+      break;
+    // sets the directory of the corpora and outputs
+    case 'w':
+      dir = optarg;
+      break;
+    // sets the extra options of the programs
+    case 'e':
+      encode_options = optarg;
+      break;
+    case 'd':
+      decode_options = optarg;
+      break;
+    // usage message
+    case 'h':
+      print_error();
+      return 0;
+    // if it's not in the above options, return an error number
+    default:
+      print_error();
+      return 1;
+    }
+  }
+  size = size * MB;
+
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Couldn't create %s\n", dir);
+    return 1;
+  }
+  uint8_t *buf = (uint8_t *)malloc(size);
+  Result *r = (Result *)malloc(sizeof(Result));
+  if (!buf || !r) {
+    fprintf(stderr, "Couldn't allocate a %" PRIu64 " byte corpus\n", size);
+    free(buf);
+    free(r);
+    return 1;
+  }
+  char corpus_path[4096];
+  char encoded_path[4096];
+  char decoded_path[4096];
+  char encode_text[4096];
+  char decode_text[4096];
+  snprintf(encode_text, sizeof(encode_text), "%s", encode_options);
+  snprintf(decode_text, sizeof(decode_text), "%s", decode_options);
+  char *encode_args[MAX_ARGS + 6] = {"./encode", "-i", corpus_path, "-o",
+                                     encoded_path};
+  char *decode_args[MAX_ARGS + 6] = {"./decode", "-i", encoded_path, "-o",
+                                     decoded_path};
+  if (!split_options(encode_text, encode_args, 5) ||
+      !split_options(decode_text, decode_args, 5)) {
+    fprintf(stderr, "Too many options\n");
+    free(buf);
+    free(r);
+    return 1;
+  }
+
+  if (json) {
+    printf("[\n");
+  } else {
+    printf("corpus,op,bytes,compressed,ratio,runs,min_s,median_s,stddev_s,"
+           "best_mb_s,median_mb_s,peak_rss_kb\n");
+  }
+  bool first = true;
+  int status = 0;
+  uint64_t count = sizeof(corpora) / sizeof(corpora[0]);
+  for (uint64_t c = 0; c < count && status == 0; c += 1) {
+    const char *name = corpora[c].name;
+    // Every corpus starts from the same seed, so it doesn't depend on the
+    // ones before it
+    uint64_t state = SEED;
+    if (!corpora[c].generate(buf, size, &state)) {
+      fprintf(stderr, "Skipping %s: couldn't build the corpus\n", name);
+      continue;
+    }
+    snprintf(corpus_path, sizeof(corpus_path), "%s/%s", dir, name);
+    snprintf(encoded_path, sizeof(encoded_path), "%s/%s.huf", dir, name);
+    snprintf(decoded_path, sizeof(decoded_path), "%s/%s.out", dir, name);
+    FILE *f = fopen(corpus_path, "wb");
+    if (!f || fwrite(buf, 1, size, f) != size) {
+      fprintf(stderr, "Couldn't write %s\n", corpus_path);
+      if (f) {
+        fclose(f);
+      }
+      status = 1;
+      break;
+    }
+    fclose(f);
+    fprintf(stderr, "Benchmarking %s...\n", name);
+
+    // Time the encoder, then the decoder on its output
+    const char *ops[] = {"encode", "decode"};
+    char **args[] = {encode_args, decode_args};
+    uint64_t compressed = 0;
+    for (uint32_t k = 0; k < 2 && status == 0; k += 1) {
+      r->runs = 0;
+      r->rss = 0;
+      for (uint32_t i = 0; i < runs; i += 1) {
+        long rss;
+        if (!run(args[k], &r->times[i], &rss)) {
+          fprintf(stderr, "./%s failed on %s\n", ops[k], name);
+          status = 1;
+          break;
+        }
+        r->runs += 1;
+        r->rss = rss > r->rss ? rss : r->rss;
+      }
+      if (status != 0) {
+        break;
+      }
+      // The decoder must give back the corpus
+      if (k == 0) {
+        compressed = file_size(encoded_path);
+      } else if (!same_file(decoded_path, buf, size)) {
+        fprintf(stderr, "The decoded %s doesn't match the corpus\n", name);
+        status = 1;
+        break;
+      }
+      print_result(json, first, name, ops[k], size, compressed, r);
+      first = false;
+    }
+  }
+  if (json) {
+    printf("\n]\n");
+  }
+  free(buf);
+  free(r);
+  return status;
+}
@@ -0,0 +1,363 @@
+#include "canonical.h"
+#include "arena.h"
+#include "code.h"
+#include "defines.h"
+#include "huffman.h"
+#include "memstats.h"
+#include "node.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Goal: canonical Huffman codes. A canonical code only depends on the length
+// of each symbol's code: the codes are handed out in order of length, and
+// symbols with the same length get consecutive codes in order of symbol. So
+// instead of the whole tree, only the code lengths have to be stored, and the
+// decoder can build its tables straight from them.
+// The code lengths are stored in one of four layouts, whichever is smallest.
+// The first byte tells which one:
+// LENGTHS_SPARSE: the number of symbols minus 1, then a (symbol, length) pair
+// of bytes for each symbol.
+// LENGTHS_NIBBLES: a 32-byte bitmap of the symbols that have a code, then the
+// length of each of those symbols in a 4-bit nibble (lowest nibble first).
+// LENGTHS_BYTES: the same bitmap, then the length of each of those symbols in
+// a byte.
+// LENGTHS_DENSE: the length of every symbol in a nibble, 0 for no code.
+// The nibble layouts can only be used when no code is longer than 15 bits.
+
+#define LENGTHS_SPARSE  0
+#define LENGTHS_NIBBLES 1
+#define LENGTHS_BYTES   2
+#define LENGTHS_DENSE   3
+
+// Sets the length of the code of every leaf below the node n, which is depth
+// edges below the root.
+static void lengths_from(Node *n, uint8_t lengths[static ALPHABET],
+                         uint8_t depth) {
+  if (n) {
+    if (!n->left && !n->right) {
+      lengths[n->symbol] = depth;
+    } else {
+      lengths_from(n->left, lengths, depth + 1);
+      lengths_from(n->right, lengths, depth + 1);
+    }
+  }
+}
+
+// Sets lengths to the length of the code of each symbol in the Huffman tree
+// with the given root, and 0 for the symbols that are not in the tree.
+void canonical_lengths(Node *root, uint8_t lengths[static ALPHABET]) {
+  memset(lengths, 0, ALPHABET);
+  lengths_from(root, lengths, 0);
+}
+
+// Sets order to the symbols that have a code, sorted by the length of their
+// code and then by symbol, which is the order the canonical codes are handed
+// out in. Returns the number of symbols in order.
+uint32_t canonical_order(uint8_t lengths[static ALPHABET],
+                         uint8_t order[static ALPHABET]) {
+  // Counting sort: count the symbols of each length, then place them
+  uint32_t start[ALPHABET + 1];
+  memset(start, 0, sizeof(start));
+  for (uint32_t i = 0; i < ALPHABET; i += 1) {
+    start[lengths[i] + 1] += 1;
+  }
+  // Symbols without a code (length 0) are counted but not placed
+  start[1] = 0;
+  for (uint32_t l = 1; l < ALPHABET; l += 1) {
+    start[l + 1] += start[l];
+  }
+  for (uint32_t i = 0; i < ALPHABET; i += 1) {
+    if (lengths[i] > 0) {
+      order[start[lengths[i]]] = i;
+      start[lengths[i]] += 1;
+    }
+  }
+  return start[ALPHABET - 1];
+}
+
+// Fills out the packed code of each symbol from the code lengths. The first
+// bit of a code is stored in the lowest position, like the rest of the
+// bitstream, so each canonical code is stored with its bits reversed.
+void canonical_codes(uint8_t lengths[static ALPHABET],
+                     PackedCode packed[static ALPHABET]) {
+  uint8_t order[ALPHABET];
+  uint32_t count = canonical_order(lengths, order);
+  memset(packed, 0, ALPHABET * sizeof(PackedCode));
+  uint64_t code = 0;
+  uint32_t length = count > 0 ? lengths[order[0]] : 0;
+  for (uint32_t i = 0; i < count; i += 1) {
+    // Longer codes start where the shorter ones left off, shifted left
+    uint32_t l = lengths[order[i]];
+    code <<= l - length;
+    length = l;
+    uint64_t reversed = 0;
+    for (uint32_t b = 0; b < l; b += 1) {
+      reversed |= ((code >> b) & 1) << (l - 1 - b);
+    }
+    packed[order[i]].bits = reversed;
+    packed[order[i]].length = l;
+    code += 1;
+  }
+}
+
+// Stores the code lengths in buf, which must hold at least MAX_TREE_SIZE
+// bytes, using the smallest layout. Returns the number of bytes stored.
+uint16_t canonical_dump(uint8_t lengths[static ALPHABET], uint8_t *buf) {
+  uint32_t count = 0;
+  uint32_t longest = 0;
+  for (uint32_t i = 0; i < ALPHABET; i += 1) {
+    if (lengths[i] > 0) {
+      count += 1;
+      longest = lengths[i] > longest ? lengths[i] : longest;
+    }
+  }
+  // The size of each layout, with the nibble layouts only when they fit
+  uint32_t sparse = 2 + 2 * count;
+  uint32_t nibbles = longest < 16 ? 1 + 32 + (count + 1) / 2 : UINT32_MAX;
+  uint32_t bytes = 1 + 32 + count;
+  uint32_t dense = longest < 16 ? 1 + ALPHABET / 2 : UINT32_MAX;
+  uint32_t size = sparse;
+  uint8_t layout = LENGTHS_SPARSE;
+  if (nibbles < size) {
+    size = nibbles;
+    layout = LENGTHS_NIBBLES;
+  }
+  if (bytes < size) {
+    size = bytes;
+    layout = LENGTHS_BYTES;
+  }
+  if (dense < size) {
+    size = dense;
+    layout = LENGTHS_DENSE;
+  }
+  memset(buf, 0, size);
+  buf[0] = layout;
+  uint32_t index = 0;
+  for (uint32_t i = 0; i < ALPHABET; i += 1) {
+    if (layout == LENGTHS_DENSE) {
+      buf[1 + i / 2] |= lengths[i] << (4 * (i % 2));
+    } else if (lengths[i] > 0 && layout == LENGTHS_SPARSE) {
+      buf[2 + 2 * index] = i;
+      buf[3 + 2 * index] = lengths[i];
+      index += 1;
+    } else if (lengths[i] > 0) {
+      buf[1 + i / 8] |= 1 << (i % 8);
+      if (layout == LENGTHS_NIBBLES) {
+        buf[33 + index / 2] |= lengths[i] << (4 * (index % 2));
+      } else {
+        buf[33 + index] = lengths[i];
+      }
+      index += 1;
+    }
+  }
+  if (layout == LENGTHS_SPARSE) {
+    buf[1] = count - 1;
+  }
+  return size;
+}
+
+// Reads the code lengths stored by canonical_dump from the size bytes of buf.
+// Returns false if buf is not a valid set of code lengths: the lengths must
+// describe a complete prefix code of at least 2 symbols, with no code longer
+// than 64 bits.
+bool canonical_load(uint16_t size, const uint8_t *buf,
+                    uint8_t lengths[static ALPHABET]) {
+  memset(lengths, 0, ALPHABET);
+  if (size < 2) {
+    return false;
+  }
+  uint32_t count = 0;
+  if (buf[0] == LENGTHS_SPARSE) {
+    count = buf[1] + 1;
+    if (size != 2 + 2 * count) {
+      return false;
+    }
+    for (uint32_t i = 0; i < count; i += 1) {
+      lengths[buf[2 + 2 * i]] = buf[3 + 2 * i];
+    }
+  } else if (buf[0] == LENGTHS_DENSE) {
+    if (size != 1 + ALPHABET / 2) {
+      return false;
+    }
+    for (uint32_t i = 0; i < ALPHABET; i += 1) {
+      lengths[i] = (buf[1 + i / 2] >> (4 * (i % 2))) & 0xF;
+    }
+  } else if (buf[0] == LENGTHS_NIBBLES || buf[0] == LENGTHS_BYTES) {
+    if (size < 33) {
+      return false;
+    }
+    for (uint32_t i = 0; i < ALPHABET; i += 1) {
+      count += (buf[1 + i / 8] >> (i % 8)) & 1;
+    }
+    uint32_t expected = buf[0] == LENGTHS_NIBBLES ? 33 + (count + 1) / 2
+                                                  : 33 + count;
+    if (size != expected) {
+      return false;
+    }
+    uint32_t index = 0;
+    for (uint32_t i = 0; i < ALPHABET; i += 1) {
+      if ((buf[1 + i / 8] >> (i % 8)) & 1) {
+        lengths[i] = buf[0] == LENGTHS_NIBBLES
+                         ? (buf[33 + index / 2] >> (4 * (index % 2))) & 0xF
+                         : buf[33 + index];
+        index += 1;
+      }
+    }
+  } else {
+    return false;
+  }
+  // Kraft's sum of 2^-length over all the codes must be exactly 1. It is
+  // added up in units of 2^-64, so reaching 1 wraps the sum around to 0.
+  uint64_t kraft = 0;
+  bool full = false;
+  uint32_t symbols = 0;
+  for (uint32_t i = 0; i < ALPHABET; i += 1) {
+    if (lengths[i] > 64 || (lengths[i] > 0 && full)) {
+      return false;
+    }
+    if (lengths[i] > 0) {
+      uint64_t unit = lengths[i] == 64 ? 1 : 1ULL << (64 - lengths[i]);
+      kraft += unit;
+      // Wrapping around to anything but 0 means the sum went past 1
+      if (kraft == 0) {
+        full = true;
+      } else if (kraft < unit) {
+        return false;
+      }
+      symbols += 1;
+    }
+  }
+  return symbols >= 2 && full;
+}
+
+// Sets lengths to the code lengths of an optimal prefix code for the symbols
+// of hist, in which no code is longer than limit bits. Uses the
+// package-merge algorithm: each symbol is a coin worth 2^-limit, 2^-(limit-1),
+// ... 2^-1 with the symbol's frequency as its cost. Starting from the
+// smallest coins, every two cheapest items are packaged into one item of the
+// next size, and merged with that size's coins. The cheapest 2n-2 items of the
+// largest size give the code: each symbol's code length is the number of its
+// coins that were picked. If limit is too small for the number of symbols, the
+// smallest possible limit is used. Returns false if the memory couldn't be
+// allocated.
+bool canonical_limit(uint64_t hist[static ALPHABET], uint32_t limit,
+                     uint8_t lengths[static ALPHABET]) {
+  memset(lengths, 0, ALPHABET);
+  // The symbols, sorted by frequency (insertion sort keeps ties in order of
+  // symbol)
+  uint8_t leaves[ALPHABET];
+  uint32_t n = 0;
+  for (uint32_t i = 0; i < ALPHABET; i += 1) {
+    if (hist[i] > 0) {
+      uint32_t j = n;
+      while (j > 0 && hist[leaves[j - 1]] > hist[i]) {
+        leaves[j] = leaves[j - 1];
+        j -= 1;
+      }
+      leaves[j] = i;
+      n += 1;
+    }
+  }
+  if (n < 2) {
+    if (n == 1) {
+      lengths[leaves[0]] = 1;
+    }
+    return true;
+  }
+  while (limit < 64 && (1ULL << limit) < n) {
+    limit += 1;
+  }
+  // Kinds holds the items of each size, from the smallest coins up: the index
+  // of a symbol's coin, or n for a package. A size has fewer than 2n items.
+  uint16_t *kinds = (uint16_t *)malloc((uint64_t)limit * 2 * n * 2);
+  uint64_t *costs = (uint64_t *)malloc(2 * n * sizeof(uint64_t));
+  uint64_t *merged = (uint64_t *)malloc(2 * n * sizeof(uint64_t));
+  if (!kinds || !costs || !merged) {
+    free(kinds);
+    free(costs);
+    free(merged);
+    return false;
+  }
+  uint32_t sizes[64];
+  for (uint32_t i = 0; i < n; i += 1) {
+    kinds[i] = i;
+    costs[i] = hist[leaves[i]];
+  }
+  sizes[0] = n;
+  for (uint32_t level = 1; level < limit; level += 1) {
+    // Merge the coins of this size with the packages of the smaller items.
+    // Coins go first on a tie.
+    uint16_t *kind = &kinds[(uint64_t)level * 2 * n];
+    uint32_t packages = sizes[level - 1] / 2;
+    uint32_t i = 0;
+    uint32_t p = 0;
+    uint32_t size = 0;
+    while (i < n || p < packages) {
+      // The cost of a package stops at UINT64_MAX instead of wrapping around
+      uint64_t package = 0;
+      if (p < packages) {
+        package = costs[2 * p] + costs[2 * p + 1];
+        package = package < costs[2 * p] ? UINT64_MAX : package;
+      }
+      if (p == packages || (i < n && hist[leaves[i]] <= package)) {
+        kind[size] = i;
+        merged[size] = hist[leaves[i]];
+        i += 1;
+      } else {
+        kind[size] = n;
+        merged[size] = package;
+        p += 1;
+      }
+      size += 1;
+    }
+    sizes[level] = size;
+    memcpy(costs, merged, size * sizeof(uint64_t));
+  }
+  // Pick the cheapest 2n-2 items of the largest size. Each picked package
+  // picks the cheapest two items of the size below it.
+  uint32_t take = 2 * n - 2;
+  for (uint32_t level = limit; level > 0; level -= 1) {
+    uint16_t *kind = &kinds[(uint64_t)(level - 1) * 2 * n];
+    uint32_t packages = 0;
+    for (uint32_t i = 0; i < take; i += 1) {
+      if (kind[i] < n) {
+        lengths[leaves[kind[i]]] += 1;
+      } else {
+        packages += 1;
+      }
+    }
+    take = 2 * packages;
+  }
+  free(kinds);
+  free(costs);
+  free(merged);
+  return true;
+}
+
+// Creates the Huffman tree of the canonical codes with the given lengths, so
+// that the codes can be stored as a tree dump. The lengths must describe a
+// complete code. The Nodes come from the arena a, which must be empty. Returns
+// the root of the tree, or NULL if the lengths don't fit in the arena.
+Node *canonical_tree(Arena *a, uint8_t lengths[static ALPHABET]) {
+  PackedCode packed[ALPHABET];
+  canonical_codes(lengths, packed);
+  Node *root = arena_node(a, 0, 0);
+  for (uint32_t i = 0; root && i < ALPHABET; i += 1) {
+    // Follow the code from the root, adding the interior nodes it needs. Bit
+    // 0 goes to the left and bit 1 goes to the right.
+    Node *n = root;
+    for (uint32_t b = 0; n && b < packed[i].length; b += 1) {
+      Node **child = (packed[i].bits >> b) & 1 ? &n->right : &n->left;
+      if (!*child) {
+        *child = arena_node(a, b + 1 == packed[i].length ? i : 0, 0);
+      }
+      n = *child;
+    }
+    if (!n) {
+      root = NULL;
+    }
+  }
+  return root;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "arena.h"
+#include "code.h"
+#include "defines.h"
+#include "node.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+void canonical_lengths(Node *root, uint8_t lengths[static ALPHABET]);
+
+uint32_t canonical_order(uint8_t lengths[static ALPHABET],
+                         uint8_t order[static ALPHABET]);
+
+void canonical_codes(uint8_t lengths[static ALPHABET],
+                     PackedCode packed[static ALPHABET]);
+
+uint16_t canonical_dump(uint8_t lengths[static ALPHABET], uint8_t *buf);
+
+bool canonical_load(uint16_t size, const uint8_t *buf,
+                    uint8_t lengths[static ALPHABET]);
+
+bool canonical_limit(uint64_t hist[static ALPHABET], uint32_t limit,
+                     uint8_t lengths[static ALPHABET]);
+
+Node *canonical_tree(Arena *a, uint8_t lengths[static ALPHABET]);
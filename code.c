@@ -168,3 +168,23 @@ void code_print(Code *c) {
   }
   printf("\n");
 }
+
+// Packs the Code into a single word, with the first bit of the Code in the
+// lowest position. Codes longer than 64 bits don't fit in a word, so their
+// PackedCode has a length of 0 and they must be written with write_code().
+PackedCode code_pack(Code *c) {
+  PackedCode p = {0, 0};
+  if (code_size(c) <= 64) {
+    // The bits array already stores the first bit in the lowest position of
+    // its first byte, so the bytes only need to be combined into a word.
+    for (uint32_t i = 0; i < (code_size(c) + 7) / 8; i += 1) {
+      p.bits |= (uint64_t)c->bits[i] << (8 * i);
+    }
+    // Clear any leftover bits above the top of the Code
+    if (code_size(c) < 64) {
+      p.bits &= (1ULL << code_size(c)) - 1;
+    }
+    p.length = code_size(c);
+  }
+  return p;
+}
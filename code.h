@@ -9,6 +9,11 @@ typedef struct {
     uint8_t bits[MAX_CODE_SIZE];
 } Code;
 
+typedef struct {
+    uint64_t bits;
+    uint32_t length;
+} PackedCode;
+
 Code code_init(void);
 
 uint32_t code_size(Code *c);
@@ -28,3 +33,5 @@ bool code_push_bit(Code *c, uint8_t bit);
 bool code_pop_bit(Code *c, uint8_t *bit);
 
 void code_print(Code *c);
+
+PackedCode code_pack(Code *c);
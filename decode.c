@@ -1,14 +1,232 @@
+#include "decoder.h"
 #include "defines.h"
+#include "frame.h"
 #include "header.h"
 #include "huffman.h"
 #include "io.h"
+#include "memstats.h"
+#include "pool.h"
+#include "stats.h"
 #include <ctype.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+// Decompresses a single Huffman stream: rebuilds the tree from its dump, and
+// decodes the symbols from the infile, using the out buffer of
+// io_buffer_size(io) bytes. Only the decoded bytes from first up to last are
+// written to the outfile, and decoding stops at last. The stream has no
+// checkpoints, so the bytes before first are decoded and thrown away. Each
+// phase is timed in stats, unless it is NULL. The number of bytes written is
+// stored in written. Returns true to indicate success, false if the stream is
+// invalid or truncated.
+bool decode_single(IO *io, int infile, int outfile, Header *h, uint8_t *out,
+                   uint64_t first, uint64_t last, Stats *stats,
+                   uint64_t *written) {
+  *written = 0;
+  stats_start(stats, io, PHASE_HEADER);
+  // Gets the dumped tree. Set all the elements to 0.
+  uint8_t tree_dump[MAX_TREE_SIZE];
+  for (uint64_t i = 0; i < MAX_TREE_SIZE; i += 1) {
+    tree_dump[i] = 0;
+  }
+  if (h->tree_size > MAX_TREE_SIZE) {
+    fprintf(stderr, "Invalid tree size\n");
+    return false;
+  }
+  read_bytes(io, infile, tree_dump, h->tree_size);
+  stats_stop(stats, io, PHASE_HEADER, h->tree_size);
+  stats_start(stats, io, PHASE_TREE);
+  // The tree is only needed to build the decode table, so it is rebuilt as a
+  // flat tree on the stack
+  FlatTree t;
+  if (!rebuild_tree(h->tree_size, tree_dump, &t)) {
+    fprintf(stderr, "Invalid tree dump\n");
+    return false;
+  }
+  Decoder *d = decoder_create(&t);
+  if (!d) {
+    fprintf(stderr, "Couldn't allocate the decode table\n");
+    return false;
+  }
+  stats_stop(stats, io, PHASE_TREE, 0);
+  stats_start(stats, io, PHASE_DECODE);
+
+  // Decode a block of symbols at a time using the lookup table, and write each
+  // block to outfile.
+  if (last > h->file_size) {
+    last = h->file_size;
+  }
+  uint64_t decoded_symbols = 0;
+  bool ok = true;
+  while (decoded_symbols < last) {
+    uint64_t n = last - decoded_symbols;
+    if (n > io_buffer_size(io)) {
+      n = io_buffer_size(io);
+    }
+    uint64_t r = decoder_decode(d, io, infile, out, n);
+    // Write the part of the block that is in the range
+    if (decoded_symbols + r > first) {
+      uint64_t skip = first > decoded_symbols ? first - decoded_symbols : 0;
+      write_bytes(io, outfile, &out[skip], r - skip);
+      *written += r - skip;
+    }
+    decoded_symbols += r;
+    // The infile ended before all the symbols were decoded
+    if (r < n) {
+      fprintf(stderr, "Compressed data is truncated\n");
+      ok = false;
+      break;
+    }
+  }
+  stats_stop(stats, io, PHASE_DECODE, decoded_symbols);
+  decoder_delete(&d);
+  return ok;
+}
+
+// Decompresses the frames of the framed format from the infile to the outfile,
+// until reaching the empty frame that marks the end. Uses the out buffer of
+// io_buffer_size(io) bytes. The number of decoded symbols is stored in
+// decoded. Returns true to indicate success, false if a frame is invalid or
+// the infile ends before the empty frame.
+bool decode_frames(IO *io, int infile, int outfile, uint8_t *out,
+                   uint64_t *decoded) {
+  *decoded = 0;
+  // The decoder of the last frame with a code, for the frames that reuse it
+  Decoder *last = NULL;
+  Frame f;
+  while (read_bytes(io, infile, (uint8_t *)&f, sizeof(Frame)) ==
+         sizeof(Frame)) {
+    // An empty frame marks the end of the frames
+    if (f.symbols == 0) {
+      decoder_delete(&last);
+      return true;
+    }
+    if (!frame_decode(io, infile, outfile, &f, &last, out,
+                      io_buffer_size(io))) {
+      break;
+    }
+    *decoded += f.symbols;
+  }
+  decoder_delete(&last);
+  fprintf(stderr, "Compressed data is truncated\n");
+  return false;
+}
+
+// Defines what members/fields a parallel decode job has.
+// Io reads and writes the files, infile and outfile are the files, index holds
+// the offset of each frame, of its first decoded byte and of the frame whose
+// code it uses, decoders shares the decoder of each code between the threads,
+// and failed is set when a frame can't be decoded.
+typedef struct {
+  IO *io;
+  int infile;
+  int outfile;
+  FrameEntry *index;
+  SharedDecoders *decoders;
+  bool failed;
+} Job;
+
+// Decodes frame i of the job, and writes its bytes straight to their final
+// position in the outfile. Runs on the threads of the pool.
+static void decode_entry(void *arg, uint32_t i) {
+  Job *job = (Job *)arg;
+  Frame f;
+  Decoder *d = shared_decoders_get(job->decoders, job->io, job->infile, i);
+  uint8_t *out = frame_decode_at(job->io, job->infile, job->index, i, d, &f);
+  shared_decoders_put(job->decoders, i);
+  if (!out || write_at(job->io, job->outfile, out, f.symbols,
+                       job->index[i].symbol) != (int)f.symbols) {
+    __atomic_store_n(&job->failed, true, __ATOMIC_RELAXED);
+  }
+  free(out);
+}
+
+// Decompresses the frames of a framed infile of file_size bytes on the threads
+// of the pool. The frames are found with the seek index (or by going from one
+// Frame header to the next), and each thread writes the frames it decodes to
+// their place in the outfile, so the infile and outfile must be regular files.
+// The number of decoded symbols is stored in decoded. Returns true to indicate
+// success, false if the frames can't be found or one of them can't be decoded.
+bool decode_parallel(IO *io, int infile, int outfile, uint64_t file_size,
+                     Pool *pool, uint64_t *decoded) {
+  *decoded = 0;
+  uint32_t entries;
+  uint64_t symbols;
+  FrameEntry *index = frame_index(io, infile, file_size, &entries, &symbols);
+  if (!index) {
+    fprintf(stderr, "Couldn't find the frames\n");
+    return false;
+  }
+  // Frames that reuse a code share the decoder of the frame that has it
+  SharedDecoders *decoders = shared_decoders_create(index, entries);
+  if (!decoders) {
+    fprintf(stderr, "Couldn't allocate the decoders\n");
+    free(index);
+    return false;
+  }
+  Job job = {io, infile, outfile, index, decoders, false};
+  pool_run(pool, decode_entry, &job, entries);
+  shared_decoders_delete(&decoders);
+  free(index);
+  if (job.failed) {
+    fprintf(stderr, "Compressed data is truncated\n");
+    return false;
+  }
+  *decoded = symbols;
+  return true;
+}
+
+// Decompresses length bytes starting at the given offset of the output of a
+// framed infile of file_size bytes, and writes them to the outfile. Only the
+// frames that hold the range are read, and inside each frame decoding starts
+// at the nearest checkpoint, so the infile must be a regular file. Uses the
+// out buffer of io_buffer_size(io) bytes. The number of bytes written is
+// stored in written. Returns true to indicate success, false if the frames
+// can't be found or the range can't be decoded.
+bool decode_range(IO *io, int infile, int outfile, uint64_t file_size,
+                  uint64_t offset, uint64_t length, uint8_t *out,
+                  uint64_t *written) {
+  *written = 0;
+  uint32_t entries;
+  uint64_t symbols;
+  FrameEntry *index = frame_index(io, infile, file_size, &entries, &symbols);
+  if (!index) {
+    fprintf(stderr, "Couldn't find the frames\n");
+    return false;
+  }
+  if (offset > symbols) {
+    offset = symbols;
+  }
+  if (length > symbols - offset) {
+    length = symbols - offset;
+  }
+  bool ok = true;
+  while (*written < length) {
+    uint64_t n = length - *written;
+    if (n > io_buffer_size(io)) {
+      n = io_buffer_size(io);
+    }
+    uint64_t r = frame_decode_range(io, infile, index, entries, symbols,
+                                    offset + *written, n, out);
+    write_bytes(io, outfile, out, r);
+    *written += r;
+    if (r < n) {
+      fprintf(stderr, "Compressed data is truncated\n");
+      ok = false;
+      break;
+    }
+  }
+  free(index);
+  return ok;
+}
+
 // A function used to print the help message
 void print_error(void) {
   fprintf(stderr, "SYNOPSIS\n");
@@ -17,13 +235,27 @@ void print_error(void) {
           "  Decompresses a file using the Huffman coding algorithm.\n\n");
 
   fprintf(stderr, "USAGE\n");
-  fprintf(stderr, "  ./decode [-h] [-i infile] [-o outfile]\n\n");
+  fprintf(stderr, "  ./decode [-h] [-v] [-i infile] [-o outfile] [-b size]\n"
+                  "          [-j threads] [-r offset:length]\n"
+                  "          [--stats-format=text|json] [--perf-counters]\n\n");
 
   fprintf(stderr, "OPTIONS\n");
   fprintf(stderr, "  -h             Program usage and help.\n");
-  fprintf(stderr, "  -v             Print compression statistics.\n");
+  fprintf(stderr, "  -v             Print compression statistics, and the time, MB/s and\n");
+  fprintf(stderr, "                 system calls of each phase.\n");
+  fprintf(stderr, "  --stats-format=format\n");
+  fprintf(stderr, "                 Print the statistics as text or json.\n");
+  fprintf(stderr, "  --perf-counters\n");
+  fprintf(stderr, "                 Print the statistics, with the cycles, instructions,\n");
+  fprintf(stderr, "                 IPC and misses per byte of each phase.\n");
   fprintf(stderr, "  -i infile      Input file to decompress.\n");
   fprintf(stderr, "  -o outfile     Output of decompressed data.\n");
+  fprintf(stderr, "  -b size        Size of the I/O buffers in bytes (default: %d).\n", BLOCK);
+  fprintf(stderr, "  -j threads     Decode frames on threads threads, when infile and\n");
+  fprintf(stderr, "                 outfile are regular files (default: 1).\n");
+  fprintf(stderr, "  -r offset:length\n");
+  fprintf(stderr, "                 Only decompress length bytes, starting at byte\n");
+  fprintf(stderr, "                 offset of the decompressed data.\n");
 }
 
 int main(int argc, char **argv) {
@@ -34,8 +266,21 @@ int main(int argc, char **argv) {
   int give_out = 0; // flag to check if a different file was given
   int give_in = 0;
   int stats = 0;
+  uint32_t buffer_size = BLOCK;
+  uint32_t threads = 1;
+  int range = 0; // flag to check if only a range of bytes was asked for
+  uint64_t range_offset = 0;
+  uint64_t range_length = 0;
+  int json = 0;     // flag to print the statistics as JSON
+  int counters = 0; // flag to add the hardware counters to the statistics
+  // The long options, which only set what the statistics show
+  struct option long_options[] = {
+      {"stats-format", required_argument, NULL, 'F'},
+      {"perf-counters", no_argument, NULL, 'P'},
+      {NULL, 0, NULL, 0}};
 
-  while ((opt = getopt(argc, argv, "i:o:vh")) != -1) { // list of valid commands
+  while ((opt = getopt_long(argc, argv, "i:o:vhb:j:r:", long_options,
+                            NULL)) != -1) { // list of valid commands
     // sets the name of input file
     if (opt == 'i') {
       give_in = 1;
@@ -50,18 +295,70 @@ int main(int argc, char **argv) {
     if (opt == 'v') {
       stats = 1;
     }
+    // enables display of statistics, as text or as JSON
+    if (opt == 'F') {
+      stats = 1;
+      if (strcmp(optarg, "text") != 0 && strcmp(optarg, "json") != 0) {
+        print_error();
+        return 1;
+      }
+      json = strcmp(optarg, "json") == 0;
+    }
+    // enables display of statistics, with the hardware counters
+    if (opt == 'P') {
+      stats = 1;
+      counters = 1;
+    }
+    // sets the size of the input and output buffers
+    if (opt == 'b') {
+      buffer_size = strtoul(optarg, NULL, 10);
+      if (buffer_size == 0) {
+        print_error();
+        return 1;
+      }
+    }
     // usage message
+    // sets the number of threads that decode frames
+    if (opt == 'j') {
+      threads = strtoul(optarg, NULL, 10);
+      if (threads == 0 || threads > MAX_THREADS) {
+        print_error();
+        return 1;
+      }
+    }
+    // only decodes length bytes starting at offset
+    if (opt == 'r') {
+      char *end;
+      range = 1;
+      range_offset = strtoull(optarg, &end, 10);
+      if (*end != ':') {
+        print_error();
+        return 1;
+      }
+      range_length = strtoull(end + 1, &end, 10);
+      if (*end != '\0') {
+        print_error();
+        return 1;
+      }
+    }
     if (opt == 'h') {
       print_error();
       return 0;
     }
     // if it's not in the above options, return an error number
-    if (opt != 'h' && opt != 'v' && opt != 'o' && opt != 'i') {
+    if (opt != 'h' && opt != 'v' && opt != 'o' && opt != 'i' && opt != 'b' &&
+        opt != 'j' && opt != 'r' && opt != 'F' && opt != 'P') {
       print_error();
       return 1;
     }
   }
 
+  IO *io = io_create(buffer_size);
+  if (!io) {
+    fprintf(stderr, "Couldn't allocate %u byte buffers\n", buffer_size);
+    return 1;
+  }
+
   // Handle files
   FILE *in = stdin;
   FILE *out = stdout;
@@ -85,72 +382,118 @@ int main(int argc, char **argv) {
   }
   int in_pointer = fileno(in);
   int out_pointer = fileno(out);
+  // Map the infile into memory if it's a regular file, so the decoder reads
+  // the compressed bits directly from the mapped pages.
+  io_map(io, in_pointer);
+
+  // Times the phases of the decoding, only if statistics were asked for
+  Stats *phases = NULL;
+  if (stats == 1 && !(phases = stats_create())) {
+    fprintf(stderr, "Couldn't allocate the statistics\n");
+    return 1;
+  }
+  // Counts each phase in the hardware counters too, if the system lets us
+  if (counters == 1 && !stats_counters(phases)) {
+    fprintf(stderr, "Hardware counters are unavailable, timing only\n");
+  }
 
   // Header. Gets the header from the input file.
-  uint8_t buff[BLOCK];
-  read_bytes(in_pointer, buff, sizeof(Header));
-  Header *h = (Header *)buff;
-  if (h->magic != MAGIC) {
+  Header h;
+  stats_start(phases, io, PHASE_HEADER);
+  if (read_bytes(io, in_pointer, (uint8_t *)&h, sizeof(Header)) !=
+          sizeof(Header) ||
+      (h.magic != MAGIC && h.magic != MAGIC_FRAMED)) {
     printf("Invalid magic number.\n");
     return 1;
   }
+  stats_stop(phases, io, PHASE_HEADER, sizeof(Header));
   // Set the permission of the output file based on the permission written in the input file.
-  if (fchmod(out_pointer, h->permissions) != 0) {
+  if (fchmod(out_pointer, h.permissions) != 0) {
     fprintf(stderr, "Chmod error");
   }
 
-  // Gets the dumped tree. Set all the elements to 0.
-  uint8_t tree_dump[h->tree_size];
-  for (uint64_t i = 0; i < h->tree_size; i += 1) {
-    tree_dump[i] = 0;
+  // Decode a block of symbols at a time, and write each block to outfile.
+  uint8_t *out_buf = (uint8_t *)malloc(io_buffer_size(io));
+  if (!out_buf) {
+    fprintf(stderr, "Couldn't allocate %u byte buffers\n", io_buffer_size(io));
+    return 1;
   }
-  read_bytes(in_pointer, tree_dump, h->tree_size);
-  Node *root = rebuild_tree(h->tree_size, tree_dump);
-  Node *current = root;
-
-  // Go through the deconstructed tree bit by bit. If the bit is 0, then go to the left, and if it's 1 go to the right.
-  // When reaching a leaf node, write the node's symbol to outfile. 
-  uint8_t bit;
   uint64_t decoded_symbols = 0;
-  while (decoded_symbols < h->file_size) {
-    if (current) { 
-    // Case 1: leaf node
-    if (!(current->left) && !(current->right)) {
-      decoded_symbols += 1;
-      write_bytes(out_pointer, &current->symbol, 1);
-      current = root;
-    }
-    // Read bit
-    if (read_bit(in_pointer, &bit)) {
-      // Case 2: go to the left
-      if (bit == 0) {
-        current = current->left;
-      }
-      // Case 3: go to the right
-      if (bit == 1) {
-        current = current->right;
-      }
-    }
+  bool ok = true; // set to false when the data can't be fully decoded
+  // Frames can be decoded in parallel when the threads can read any part of
+  // the infile and write any part of the outfile
+  struct stat in_stats;
+  struct stat out_stats;
+  bool regular = fstat(in_pointer, &in_stats) == 0 && S_ISREG(in_stats.st_mode);
+  bool random_access = regular && fstat(out_pointer, &out_stats) == 0 &&
+                       S_ISREG(out_stats.st_mode);
+  if (range == 1 && h.magic == MAGIC_FRAMED && !regular) {
+    fprintf(stderr, "Range decoding of framed data needs a regular infile\n");
+    return 1;
+  } else if (range == 1 && h.magic == MAGIC_FRAMED) {
+    stats_start(phases, io, PHASE_DECODE);
+    ok = decode_range(io, in_pointer, out_pointer, in_stats.st_size,
+                      range_offset, range_length, out_buf, &decoded_symbols);
+    stats_stop(phases, io, PHASE_DECODE, decoded_symbols);
+  } else if (range == 1) {
+    // Decode up to the end of the range without going past the end of the
+    // data
+    uint64_t last = range_offset + range_length < range_offset
+                        ? UINT64_MAX
+                        : range_offset + range_length;
+    ok = decode_single(io, in_pointer, out_pointer, &h, out_buf, range_offset,
+                       last, phases, &decoded_symbols);
+  } else if (h.magic == MAGIC_FRAMED && threads > 1 && random_access) {
+    Pool *pool = pool_create(threads);
+    if (!pool) {
+      fprintf(stderr, "Couldn't start %u threads\n", threads);
+      return 1;
     }
+    stats_start(phases, io, PHASE_DECODE);
+    ok = decode_parallel(io, in_pointer, out_pointer, in_stats.st_size, pool,
+                         &decoded_symbols);
+    stats_stop(phases, io, PHASE_DECODE, decoded_symbols);
+    pool_delete(&pool);
+  } else if (h.magic == MAGIC_FRAMED) {
+    // Each frame has its own code, so the frames are timed as one phase
+    stats_start(phases, io, PHASE_DECODE);
+    ok = decode_frames(io, in_pointer, out_pointer, out_buf,
+                       &decoded_symbols);
+    stats_stop(phases, io, PHASE_DECODE, decoded_symbols);
+  } else {
+    ok = decode_single(io, in_pointer, out_pointer, &h, out_buf, 0,
+                       h.file_size, phases, &decoded_symbols);
   }
   // Statistics, print the compressed file size, the decompress one, and the space saving.
-  extern uint64_t bytes_read;
   if (stats == 1) {
-    int64_t compressed_size;
-    compressed_size = (double)bytes_read;
-    double space_saving = 100 * (1 - (compressed_size / (double)h->file_size));
-    fprintf(stderr,
-            "Compressed file size: %lu bytes\nDecompressed file size: %ld "
-            "bytes\nSpace saving: %.2lf%%\n",
-            compressed_size, h->file_size, space_saving);
+    // Parallel and range decoding read some headers and codes more than
+    // once, so a regular infile reports its size instead of the bytes read.
+    // A pipe is read once, from start to end.
+    int64_t compressed_size =
+        regular ? in_stats.st_size : (int64_t)io_bytes_read(io);
+    double space_saving =
+        100 * (1 - (compressed_size / (double)decoded_symbols));
+    if (json == 1) {
+      stats_print_json(phases, stderr, decoded_symbols, compressed_size);
+    } else {
+      fprintf(stderr,
+              "Compressed file size: %lu bytes\nDecompressed file size: %ld "
+              "bytes\nSpace saving: %.2lf%%\n",
+              compressed_size, decoded_symbols, space_saving);
+      stats_print(phases, stderr);
+    }
   }
+  stats_delete(&phases);
   
   // Delete and close for memory leaks
-  delete_tree(&root);
+  free(out_buf);
   if (give_in == 1) {
     fclose(in);
   }
   if (give_out == 1) {
     fclose(out);
   }
+  io_delete(&io);
+  // Exit with an error if the data couldn't be fully decoded
+  return ok ? 0 : 1;
 }
@@ -0,0 +1,543 @@
+#include "decoder.h"
+#include "canonical.h"
+#include "code.h"
+#include "defines.h"
+#include "io.h"
+#include "memstats.h"
+#include "node.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Goal: decode a Huffman bitstream several bits at a time instead of walking
+// the tree one bit at a time. The tree is turned into a lookup table that is
+// indexed by the next LOOKUP_BITS bits of the input. Each entry tells which
+// symbol those bits start with and how many bits its code uses. Codes that are
+// longer than the table point to a smaller second-level table that is indexed
+// by the bits that follow. The tables are built from a flat tree (see
+// FlatTree), or for canonical codes, straight from the code lengths. When the
+// codes are short, a second table that is indexed by the same bits holds all
+// the symbols (up to MULTI_SYMBOLS) that start in those bits, so one lookup
+// decodes several symbols.
+
+// Defines what members/fields an entry of the lookup table has.
+// Symbol is the decoded symbol (leaf entries).
+// Length is the number of bits the entry consumes.
+// Sub is the number of bits that index the second-level table, or 0 when the
+// entry is a leaf.
+// Next is the offset of the second-level table in the entries array.
+typedef struct {
+  uint8_t symbol;
+  uint8_t length;
+  uint8_t sub;
+  uint32_t next;
+} Entry;
+
+// Defines what members/fields an entry of the multi-symbol table has.
+// Symbols holds the count symbols whose codes fit in the index bits, in order,
+// and length is the total number of bits of their codes. A count of 0 means
+// that the first code doesn't fit, so the symbol is decoded with entries.
+typedef struct {
+  uint8_t symbols[MULTI_SYMBOLS];
+  uint8_t count;
+  uint8_t length;
+} Multi;
+
+// Defines what members/fields a bit reader has.
+// Acc holds the bits that were read but not decoded yet, with the next bit in
+// the lowest position, and count is the number of valid bits in acc.
+// Block points at the last block of bytes read, pos is the next byte to move
+// into acc and end is the number of bytes in the block.
+typedef struct {
+  uint64_t acc;
+  uint32_t count;
+  const uint8_t *block;
+  uint32_t pos;
+  uint32_t end;
+} Bits;
+
+// Defines what members/fields the Decoder structure has.
+// Lookup is the number of bits that index the first-level table.
+// Size is the total number of entries of all tables, and entries holds them
+// (the first-level table starts at offset 0). Multi is the multi-symbol table,
+// or NULL when the codes are too long for it to pay off.
+// Bits reads the bitstream that decoder_decode decodes.
+struct Decoder {
+  uint32_t lookup;
+  uint32_t size;
+  Entry *entries;
+  Multi *multi;
+  Bits bits;
+};
+
+// Returns the number of edges on the longest path from the node r of the flat
+// tree to a leaf. Height holds the height of each interior node.
+static uint32_t tree_height(uint8_t *height, uint16_t r) {
+  return r & FLAT_LEAF ? 0 : height[r];
+}
+
+// Returns the number of index bits for a second-level table whose codes start
+// at the node r. It is never more than SUB_BITS, deeper codes get another
+// level.
+static uint32_t sub_bits(uint8_t *height, uint16_t r) {
+  uint32_t h = tree_height(height, r);
+  return h < SUB_BITS ? h : SUB_BITS;
+}
+
+// Counts the number of entries needed by the second-level tables below the
+// node r of the flat tree t, where r is at the given depth of a table with
+// bits index bits.
+static uint32_t count_entries(FlatTree *t, uint8_t *height, uint16_t r,
+                              uint32_t depth, uint32_t bits) {
+  if (r & FLAT_LEAF) {
+    return 0;
+  }
+  // The node starts a new table
+  if (depth == bits) {
+    uint32_t sub = sub_bits(height, r);
+    return (1U << sub) + count_entries(t, height, r, 0, sub);
+  }
+  return count_entries(t, height, t->child[r][0], depth + 1, bits) +
+         count_entries(t, height, t->child[r][1], depth + 1, bits);
+}
+
+// Fills the table that starts at offset base and has bits index bits. The node
+// r of the flat tree t is reached from the table's root by the code (first bit
+// in the lowest position) that is depth bits long. Returns the next free
+// offset of the entries array.
+static uint32_t fill_table(Decoder *d, FlatTree *t, uint8_t *height,
+                           uint32_t base, uint32_t bits, uint16_t r,
+                           uint32_t code, uint32_t depth, uint32_t free) {
+  // Leaf node: every index that starts with the code decodes to the symbol
+  if (r & FLAT_LEAF) {
+    Entry e = {r & 0xFF, depth, 0, 0};
+    for (uint32_t i = code; i < (1U << bits); i += (1U << depth)) {
+      d->entries[base + i] = e;
+    }
+    return free;
+  }
+  // Interior node at the end of the table: link it to a new table that is
+  // indexed by the bits after this one
+  if (depth == bits) {
+    uint32_t sub = sub_bits(height, r);
+    Entry e = {0, bits, sub, free};
+    d->entries[base + code] = e;
+    uint32_t next = free;
+    free += (1U << sub);
+    return fill_table(d, t, height, next, sub, r, 0, 0, free);
+  }
+  // Interior node: bit 0 goes to the left and bit 1 goes to the right
+  free = fill_table(d, t, height, base, bits, t->child[r][0], code, depth + 1,
+                    free);
+  return fill_table(d, t, height, base, bits, t->child[r][1],
+                    code | (1U << depth), depth + 1, free);
+}
+
+// Starts reading a new bitstream from the size bytes of block.
+static void bits_reset(Bits *b, const uint8_t *block, uint32_t size) {
+  b->acc = 0;
+  b->count = 0;
+  b->block = block;
+  b->pos = 0;
+  b->end = size;
+}
+
+// Allocates a Decoder whose first-level table has lookup index bits, and whose
+// tables have size entries in total. Returns NULL if the memory couldn't be
+// allocated.
+static Decoder *decoder_alloc(uint32_t lookup, uint32_t size) {
+  Decoder *d = (Decoder *)malloc(sizeof(Decoder));
+  if (d) {
+    d->lookup = lookup;
+    d->size = size;
+    d->entries = (Entry *)calloc(d->size, sizeof(Entry));
+    if (!d->entries) {
+      free(d);
+      return NULL;
+    }
+    d->multi = NULL;
+    decoder_reset(d, NULL, 0);
+  }
+  return d;
+}
+
+// Builds the multi-symbol table from the first-level table, and keeps it only
+// if it decodes at least MULTI_MIN symbols per 100 lookups on average (fewer
+// than that, and the longer loop costs more than the lookups it saves). Every
+// index of the table is as likely as the bits of the input when the symbols
+// have the probabilities that their code lengths imply, so the average over
+// the whole table is the expected number of symbols per lookup. The decoder
+// works without the table, so it is left out if the memory couldn't be
+// allocated.
+static void build_multi(Decoder *d) {
+  if (d->lookup == 0) {
+    return;
+  }
+  uint32_t mask = (1U << d->lookup) - 1;
+  d->multi = (Multi *)calloc(mask + 1, sizeof(Multi));
+  if (!d->multi) {
+    return;
+  }
+  uint64_t total = 0;
+  for (uint32_t i = 0; i <= mask; i += 1) {
+    Multi *m = &d->multi[i];
+    // Decode the symbols one at a time with the first-level table, while the
+    // whole code is in the index bits
+    uint32_t used = 0;
+    while (m->count < MULTI_SYMBOLS) {
+      Entry e = d->entries[i >> used];
+      if (e.sub != 0 || e.length > d->lookup - used) {
+        break;
+      }
+      m->symbols[m->count] = e.symbol;
+      m->count += 1;
+      used += e.length;
+    }
+    m->length = used;
+    total += m->count;
+  }
+  if (100 * total < ((uint64_t)MULTI_MIN << d->lookup)) {
+    free(d->multi);
+    d->multi = NULL;
+  }
+}
+
+// The constructor for a Decoder. Creates the lookup tables for the flat
+// Huffman tree t and returns a pointer to the Decoder if the memory was
+// allocated succesfully. Else, return NULL.
+Decoder *decoder_create(FlatTree *t) {
+  // The children of a node come before it in t, so the heights of all the
+  // nodes take a single pass. A tree of ALPHABET leaves is at most
+  // ALPHABET - 1 high.
+  uint8_t height[ALPHABET - 1];
+  for (uint32_t i = 0; i < t->size; i += 1) {
+    uint32_t left = tree_height(height, t->child[i][0]);
+    uint32_t right = tree_height(height, t->child[i][1]);
+    height[i] = 1 + (left > right ? left : right);
+  }
+  // Small trees don't need the whole first-level table
+  uint32_t h = tree_height(height, t->root);
+  uint32_t lookup = h < LOOKUP_BITS ? h : LOOKUP_BITS;
+  Decoder *d = decoder_alloc(
+      lookup, (1U << lookup) + count_entries(t, height, t->root, 0, lookup));
+  if (d) {
+    fill_table(d, t, height, 0, d->lookup, t->root, 0, 0, 1U << d->lookup);
+    build_multi(d);
+  }
+  return d;
+}
+
+// Fills the table that starts at offset base and has bits index bits with the
+// symbols order[first] to order[last - 1] of the canonical order, or only
+// counts the entries of the tables below it when fill is false. Packed holds
+// the codes (first bit in the lowest position), and the tables above this one
+// used the first shift bits of each code. Returns the next free offset of the
+// entries array.
+static uint32_t fill_canonical(Decoder *d, bool fill, uint32_t base,
+                               uint32_t bits, uint32_t shift, uint8_t *order,
+                               PackedCode *packed, uint32_t first,
+                               uint32_t last, uint32_t free) {
+  uint32_t mask = (1U << bits) - 1;
+  uint32_t i = first;
+  while (i < last) {
+    PackedCode p = packed[order[i]];
+    uint32_t length = p.length - shift;
+    uint32_t code = (p.bits >> shift) & mask;
+    // The code ends in this table: every index that starts with it decodes to
+    // the symbol
+    if (length <= bits) {
+      Entry e = {order[i], length, 0, 0};
+      for (uint32_t j = code; fill && j <= mask; j += (1U << length)) {
+        d->entries[base + j] = e;
+      }
+      i += 1;
+      continue;
+    }
+    // The code goes past this table. The codes that start with the same bits
+    // are next to each other in the canonical order, and the last of them is
+    // the longest, so they get a new table that fits the longest one.
+    uint32_t end = i + 1;
+    while (end < last && ((packed[order[end]].bits >> shift) & mask) == code) {
+      end += 1;
+    }
+    uint32_t sub = packed[order[end - 1]].length - shift - bits;
+    sub = sub < SUB_BITS ? sub : SUB_BITS;
+    Entry e = {0, bits, sub, free};
+    if (fill) {
+      d->entries[base + code] = e;
+    }
+    free = fill_canonical(d, fill, free, sub, shift + bits, order, packed, i,
+                          end, free + (1U << sub));
+    i = end;
+  }
+  return free;
+}
+
+// The constructor for a Decoder of canonical codes. Creates the lookup tables
+// straight from the length of each symbol's code, without a tree. The lengths
+// must describe a complete code (see canonical_load). Returns a pointer to the
+// Decoder if the memory was allocated succesfully. Else, return NULL.
+Decoder *decoder_create_lengths(uint8_t lengths[static ALPHABET]) {
+  PackedCode packed[ALPHABET];
+  canonical_codes(lengths, packed);
+  uint8_t order[ALPHABET];
+  uint32_t count = canonical_order(lengths, order);
+  // The codes are sorted by length, so the last one is the longest
+  uint32_t longest = count > 0 ? lengths[order[count - 1]] : 0;
+  uint32_t lookup = longest < LOOKUP_BITS ? longest : LOOKUP_BITS;
+  uint32_t size = fill_canonical(NULL, false, 0, lookup, 0, order, packed, 0,
+                                 count, 1U << lookup);
+  Decoder *d = decoder_alloc(lookup, size);
+  if (d) {
+    fill_canonical(d, true, 0, lookup, 0, order, packed, 0, count,
+                   1U << lookup);
+    build_multi(d);
+  }
+  return d;
+}
+
+// The destructor for a Decoder. Frees the tables and the Decoder, and set the
+// pointer to NULL.
+void decoder_delete(Decoder **d) {
+  if (*d) {
+    free((*d)->entries);
+    (*d)->entries = NULL;
+    free((*d)->multi);
+    (*d)->multi = NULL;
+    free(*d);
+    *d = NULL;
+  }
+}
+
+// Starts decoding a new bitstream that is stored in memory. The size argument
+// is the number of bytes in the block. Call decoder_decode with a NULL io to
+// decode only from the block.
+void decoder_reset(Decoder *d, const uint8_t *block, uint32_t size) {
+  bits_reset(&d->bits, block, size);
+}
+
+// Moves bytes from the block into the bit accumulator of b until it holds at
+// least 57 bits. Reads a new block from the infile with the io when the block
+// runs out. Returns false if there are no more bits in the infile.
+static inline bool refill(Bits *b, IO *io, int infile) {
+  // Fast path: load 8 bytes at once and keep only the whole bytes that fit
+  if (b->end - b->pos >= 8) {
+    uint64_t word;
+    memcpy(&word, &b->block[b->pos], sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    b->acc |= word << b->count;
+    b->pos += (63 - b->count) >> 3;
+    b->count |= 56;
+    return true;
+  }
+  // Slow path near the end of the block: one byte at a time
+  while (b->count <= 56) {
+    if (b->pos == b->end) {
+      // A NULL io means that all the bits are in the current block
+      uint8_t *block;
+      int r = io ? read_block(io, infile, &block) : 0;
+      if (r <= 0) {
+        return b->count > 0;
+      }
+      b->block = block;
+      b->pos = 0;
+      b->end = r;
+    }
+    b->acc |= (uint64_t)b->block[b->pos] << b->count;
+    b->pos += 1;
+    b->count += 8;
+  }
+  return true;
+}
+
+// Skips the next bits bits of the bitstream, at most 57. Returns false if
+// there are not that many bits left.
+bool decoder_skip(Decoder *d, uint32_t bits) {
+  Bits *b = &d->bits;
+  if (b->count < bits) {
+    refill(b, NULL, -1);
+  }
+  if (b->count < bits) {
+    return false;
+  }
+  b->acc >>= bits;
+  b->count -= bits;
+  return true;
+}
+
+// Decodes one symbol from the bitstream of b, read from the infile with the
+// io, to *symbol. Returns false if the infile ended before the end of its
+// code.
+static inline bool decode_symbol(Decoder *d, Bits *b, IO *io, int infile,
+                                 uint8_t *symbol) {
+  uint32_t base = 0;
+  uint32_t bits = d->lookup;
+  Entry e;
+  // Follow the links until reaching a leaf entry
+  while (true) {
+    if (b->count < bits && !refill(b, io, infile)) {
+      return false;
+    }
+    // Past the end of the infile, the missing bits are read as zeros
+    e = d->entries[base + (b->acc & ((1ULL << bits) - 1))];
+    if (e.sub == 0) {
+      break;
+    }
+    // A link is a prefix of a longer code, so the infile ended inside it
+    if (b->count < bits) {
+      return false;
+    }
+    b->acc >>= bits;
+    b->count -= bits;
+    base = e.next;
+    bits = e.sub;
+  }
+  // The code of the symbol can't be longer than the bits left in the infile
+  if (e.length > b->count) {
+    return false;
+  }
+  b->acc >>= e.length;
+  b->count -= e.length;
+  *symbol = e.symbol;
+  return true;
+}
+
+// Decodes the symbols of a multi-symbol entry from the bitstream of b to out,
+// which must have room for MULTI_SYMBOLS bytes. When the entry is empty, or
+// longer than the bits in the accumulator, only one symbol is decoded the
+// usual way. Returns the number of symbols decoded, which is 0 only if the
+// infile ended early.
+static inline uint32_t decode_multi(Decoder *d, Bits *b, IO *io, int infile,
+                                    uint8_t *out) {
+  Multi *m = &d->multi[b->acc & ((1ULL << d->lookup) - 1)];
+  if (m->count == 0 || m->length > b->count) {
+    return decode_symbol(d, b, io, infile, out) ? 1 : 0;
+  }
+  memcpy(out, m->symbols, MULTI_SYMBOLS);
+  b->acc >>= m->length;
+  b->count -= m->length;
+  return m->count;
+}
+
+// Decodes n symbols from the bitstream of b, read from the infile with the io,
+// to the out buffer. Returns the number of symbols decoded, which is less than
+// n only if the infile ended early.
+static uint64_t decode_bits(Decoder *d, Bits *b, IO *io, int infile,
+                            uint8_t *out, uint64_t n) {
+  uint64_t i = 0;
+  // Several symbols per lookup while there is room for all of an entry's
+  // symbols in out
+  if (d->multi) {
+    while (n - i >= MULTI_SYMBOLS) {
+      if (b->count < d->lookup) {
+        refill(b, io, infile);
+      }
+      uint32_t r = decode_multi(d, b, io, infile, &out[i]);
+      if (r == 0) {
+        return i;
+      }
+      i += r;
+    }
+  }
+  for (; i < n; i += 1) {
+    if (!decode_symbol(d, b, io, infile, &out[i])) {
+      return i;
+    }
+  }
+  return n;
+}
+
+// Decodes n symbols from the infile, read with the io, to the out buffer.
+// Returns the number of symbols decoded, which is less than n only if the
+// infile ended early.
+uint64_t decoder_decode(Decoder *d, IO *io, int infile, uint8_t *out,
+                        uint64_t n) {
+  return decode_bits(d, &d->bits, io, infile, out, n);
+}
+
+// Decodes n symbols from the size bytes of block to the out buffer, starting
+// at the block's first bit. The bitstream is read with its own bit reader, so
+// the decoder is only read, and several threads can share it. Returns true to
+// indicate success, false if the block ended early.
+bool decoder_decode_block(Decoder *d, const uint8_t *block, uint32_t size,
+                          uint8_t *out, uint64_t n) {
+  Bits b;
+  bits_reset(&b, block, size);
+  return decode_bits(d, &b, NULL, -1, out, n) == n;
+}
+
+// Decodes the n symbols of STREAMS interleaved bitstreams to out. Stream j
+// holds the sizes[j] bytes of streams[j], and is the code of the symbols
+// from j * q up to (j + 1) * q (or n), where q = (n + STREAMS - 1) / STREAMS.
+// The streams are decoded in the same loop, so the lookups of one stream
+// don't wait for the code lengths of another. Returns true to indicate
+// success, false otherwise.
+bool decoder_decode_streams(Decoder *d,
+                            const uint8_t *streams[static STREAMS],
+                            uint32_t sizes[static STREAMS], uint8_t *out,
+                            uint64_t n) {
+  uint64_t q = (n + STREAMS - 1) / STREAMS;
+  Bits b[STREAMS];
+  uint8_t *next[STREAMS];
+  uint8_t *end[STREAMS];
+  for (uint32_t j = 0; j < STREAMS; j += 1) {
+    bits_reset(&b[j], streams[j], sizes[j]);
+    next[j] = &out[j * q < n ? j * q : n];
+    end[j] = &out[(j + 1) * q < n ? (j + 1) * q : n];
+  }
+  // Every round fills the accumulator of each stream once, which holds at
+  // least 56 bits, and then decodes one lookup after the other from all the
+  // streams until 56 bits could be used up. The rounds go on while all the
+  // streams have room for the round's symbols in out and 8 bytes left for a
+  // fast refill.
+  uint32_t lookups = d->lookup == 0 ? 0 : 56 / d->lookup;
+  uint32_t room = lookups * (d->multi ? MULTI_SYMBOLS : 1);
+  while (lookups > 0) {
+    bool fast = true;
+    for (uint32_t j = 0; j < STREAMS; j += 1) {
+      fast = fast && end[j] - next[j] >= room && b[j].end - b[j].pos >= 8;
+    }
+    if (!fast) {
+      break;
+    }
+    for (uint32_t j = 0; j < STREAMS; j += 1) {
+      refill(&b[j], NULL, -1);
+    }
+    for (uint32_t k = 0; k < lookups; k += 1) {
+      for (uint32_t j = 0; j < STREAMS; j += 1) {
+        uint32_t r = d->multi ? decode_multi(d, &b[j], NULL, -1, next[j])
+                     : decode_symbol(d, &b[j], NULL, -1, next[j]);
+        if (r == 0) {
+          return false;
+        }
+        next[j] += r;
+      }
+    }
+  }
+  // Each stream decodes the rest of its symbols on its own
+  for (uint32_t j = 0; j < STREAMS; j += 1) {
+    uint64_t left = end[j] - next[j];
+    if (decode_bits(d, &b[j], NULL, -1, next[j], left) != left) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// A debug function that prints all characteristics of the Decoder.
+void decoder_print(Decoder *d) {
+  printf("Lookup bits: %u, Entries: %u, Multi-symbol: %s\n", d->lookup,
+         d->size, d->multi ? "yes" : "no");
+  for (uint32_t i = 0; i < d->size; i += 1) {
+    Entry *e = &d->entries[i];
+    if (e->sub) {
+      printf("%u: link to %u (%u bits)\n", i, e->next, e->sub);
+    } else {
+      printf("%u: symbol %02X (%u bits)\n", i, e->symbol, e->length);
+    }
+  }
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "defines.h"
+#include "io.h"
+#include "node.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct Decoder Decoder;
+
+Decoder *decoder_create(FlatTree *t);
+
+Decoder *decoder_create_lengths(uint8_t lengths[static ALPHABET]);
+
+void decoder_delete(Decoder **d);
+
+void decoder_reset(Decoder *d, const uint8_t *block, uint32_t size);
+
+bool decoder_skip(Decoder *d, uint32_t bits);
+
+uint64_t decoder_decode(Decoder *d, IO *io, int infile, uint8_t *out,
+                        uint64_t n);
+
+bool decoder_decode_block(Decoder *d, const uint8_t *block, uint32_t size,
+                          uint8_t *out, uint64_t n);
+
+bool decoder_decode_streams(Decoder *d,
+                            const uint8_t *streams[static STREAMS],
+                            uint32_t sizes[static STREAMS], uint8_t *out,
+                            uint64_t n);
+
+void decoder_print(Decoder *d);
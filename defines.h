@@ -3,5 +3,34 @@
 #define BLOCK         4096               // 4KB blocks.
 #define ALPHABET      256                // ASCII + Extended ASCII.
 #define MAGIC         0xBEEFBBAD         // 32-bit magic number.
+#define MAGIC_FRAMED  0xBEEFBBAE         // Magic number of the framed format.
+#define MAGIC_INDEX   0xBEEFBBAF         // Magic number of the seek index.
 #define MAX_CODE_SIZE (ALPHABET / 8)     // Bytes for a maximum, 256-bit code.
 #define MAX_TREE_SIZE (3 * ALPHABET - 1) // Maximum Huffman tree dump size.
+#define LOOKUP_BITS   11                 // Index bits of the decode table.
+#define SUB_BITS      8                  // Index bits of a second-level table.
+#define MAP_CHUNK     (1 << 30)          // Largest block of a mapped file.
+#define ATTACHED_FD   (-2)               // Descriptor of an IO's attached bytes.
+#define FRAME_SIZE    (1 << 20)          // Default bytes of input per frame.
+#define MAX_FRAME     (1 << 30)          // Largest bytes of input per frame.
+#define MAX_THREADS   256                // Most threads of a worker pool.
+#define DECODER_LOCKS 64                 // Locks of the decoders of threads.
+#define MAX_SITES     32                 // Most files counted by MEMSTATS.
+#define MIN_PHASE_SECONDS 0.001          // Least time of a phase with MB/s.
+#define FRAME_CHECKPOINTS 0x1            // Frame payload has a checkpoint table.
+#define FRAME_CANONICAL   0x2            // Frame stores code lengths, not a tree.
+#define FRAME_STREAMS     0x4            // Frame has interleaved bitstreams.
+#define FRAME_REUSE       0x8            // Frame uses the last frame's code.
+#define REUSE_MIN         64             // Least bytes a frame's own code saves.
+#define MAX_LIMIT         64             // Longest code of a length limit.
+#define MAX_NODES         (2 * ALPHABET - 1) // Most Nodes of a Huffman tree.
+#define FLAT_LEAF         0x8000         // Flat tree index that is a leaf.
+#define MULTI_SYMBOLS     4              // Most symbols of a decode lookup.
+#define MULTI_MIN         150            // Least symbols per 100 lookups.
+#define STREAMS           4              // Bitstreams of an interleaved frame.
+#define HIST_WAYS         4              // Sub-histograms of a histogram.
+#define HIST_SMALL        1024           // Bytes below which one table is used.
+#define HIST_CHUNK        (1U << 30)     // Most bytes per sub-histogram pass.
+#define HIST_SPLIT        (1 << 24)      // Least bytes per histogram thread.
+#define SAMPLE_PIECE      (1 << 20)      // Bytes per piece of a sample (1 MB).
+#define MAX_SAMPLE        (1 << 20)      // Most MB of a sample.
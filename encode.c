@@ -1,12 +1,21 @@
+#include "arena.h"
+#include "canonical.h"
 #include "code.h"
 #include "defines.h"
+#include "frame.h"
 #include "header.h"
+#include "histogram.h"
 #include "huffman.h"
 #include "io.h"
+#include "memstats.h"
 #include "node.h"
+#include "pool.h"
 #include "pq.h"
 #include "stack.h"
+#include "stats.h"
+#include <getopt.h>
 #include <inttypes.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,6 +37,13 @@ void pq_test(void);
 void io_test(int infile, int outfile);
 void huffman_test(int outfile);*/
 
+bool encode_single(IO *io, int infile, int outfile, Header *h,
+                   uint32_t limit, uint64_t sample, Pool *pool, Stats *stats);
+bool encode_frames(IO *io, int infile, int outfile, Header *h,
+                   uint32_t frame_size, uint32_t interval, uint32_t limit,
+                   bool streams, bool reuse, Pool *pool, bool index,
+                   Stats *stats, uint64_t *encoded);
+
 // Function to print the help message
 void print_error(void) {
   fprintf(stderr, "SYNOPSIS\n");
@@ -36,25 +52,71 @@ void print_error(void) {
           "  Compresses a file using the Huffman coding algorithm.\n\n");
 
   fprintf(stderr, "USAGE\n");
-  fprintf(stderr, "  ./encode [-h] [-i infile] [-o outfile]\n\n");
+  fprintf(stderr, "  ./encode [-h] [-v] [-i infile] [-o outfile] [-b size] [-B size]\n"
+                  "          [-j threads] [-t threads] [-x] [-k interval] [-l bits]\n"
+                  "          [-s] [-S mb] [-R] [--stats-format=text|json]\n"
+                  "          [--perf-counters]\n\n");
 
   fprintf(stderr, "OPTIONS\n");
   fprintf(stderr, "  -h             Program usage and help.\n");
-  fprintf(stderr, "  -v             Print compression statistics.\n");
+  fprintf(stderr, "  -v             Print compression statistics, and the time, MB/s and\n");
+  fprintf(stderr, "                 system calls of each phase.\n");
+  fprintf(stderr, "  --stats-format=format\n");
+  fprintf(stderr, "                 Print the statistics as text or json.\n");
+  fprintf(stderr, "  --perf-counters\n");
+  fprintf(stderr, "                 Print the statistics, with the cycles, instructions,\n");
+  fprintf(stderr, "                 IPC and misses per byte of each phase.\n");
   fprintf(stderr, "  -i infile      Input file to compress.\n");
   fprintf(stderr, "  -o outfile     Output of compressed data.\n");
+  fprintf(stderr, "  -b size        Size of the I/O buffers in bytes (default: %d).\n", BLOCK);
+  fprintf(stderr, "  -B size        Use the framed format with frames of size bytes\n");
+  fprintf(stderr, "                 (default: %d). Used for pipes.\n", FRAME_SIZE);
+  fprintf(stderr, "  -j threads     Use the framed format, and encode frames on\n");
+  fprintf(stderr, "                 threads threads (default: 1).\n");
+  fprintf(stderr, "  -t threads     Count the bytes of a large regular infile on threads\n");
+  fprintf(stderr, "                 threads, keeping the single-stream format.\n");
+  fprintf(stderr, "  -x             Use the framed format, and add a seek index.\n");
+  fprintf(stderr, "  -k interval    Use the framed format, and add a checkpoint every\n");
+  fprintf(stderr, "                 interval bytes of each frame for range decoding.\n");
+  fprintf(stderr, "  -l bits        Limit the length of the codes to bits bits (1-%d,\n", MAX_LIMIT);
+  fprintf(stderr, "                 default: no limit).\n");
+  fprintf(stderr, "  -s             Use the framed format, and split each frame into %d\n", STREAMS);
+  fprintf(stderr, "                 interleaved bitstreams for faster decoding.\n");
+  fprintf(stderr, "  -R             Use the framed format, and let a frame reuse the\n");
+  fprintf(stderr, "                 last frame's code when its own would save little.\n");
+  fprintf(stderr, "  -S mb          Build the tree from a sample of mb MB spread over a\n");
+  fprintf(stderr, "                 regular infile, and read the rest of it only once.\n");
 }
 
 int main(int argc, char **argv) {
   int opt = 0; // used for getopt
   // set default numbers
-  char input_name[BLOCK];
-  char output_name[BLOCK];
+  char input_name[BLOCK] = "stdin";
+  char output_name[BLOCK] = "stdout";
   int give_out = 0; // flag to check if a different file was given
   int give_in = 0;
   int stats = 0;
+  uint32_t buffer_size = BLOCK;
+  int framed = 0; // flag to check if the framed format was asked for
+  uint32_t frame_size = FRAME_SIZE;
+  uint32_t frame_threads = 1; // threads that encode frames (-j)
+  uint32_t hist_threads = 1;  // threads that count the bytes (-t)
+  int seek_index = 0;
+  uint32_t interval = 0;
+  uint32_t limit = 0;
+  int streams = 0;
+  uint64_t sample = 0;
+  int reuse = 0;
+  int json = 0;     // flag to print the statistics as JSON
+  int counters = 0; // flag to add the hardware counters to the statistics
+  // The long options, which only set what the statistics show
+  struct option long_options[] = {
+      {"stats-format", required_argument, NULL, 'F'},
+      {"perf-counters", no_argument, NULL, 'P'},
+      {NULL, 0, NULL, 0}};
 
-  while ((opt = getopt(argc, argv, "i:o:vh")) != -1) { // list of valid commands
+  while ((opt = getopt_long(argc, argv, "i:o:vhb:B:j:t:xk:l:sS:R",
+                            long_options, NULL)) != -1) { // list of valid commands
     // sets the name of input file
     switch (opt) {
     case 'i':
@@ -70,6 +132,101 @@ int main(int argc, char **argv) {
     case 'v':
       stats = 1;
       break;
+    // enables display of statistics, as text or as JSON
+    case 'F':
+      stats = 1;
+      if (strcmp(optarg, "text") != 0 && strcmp(optarg, "json") != 0) {
+        print_error();
+        return 1;
+      }
+      json = strcmp(optarg, "json") == 0;
+      break;
+    // enables display of statistics, with the hardware counters
+    case 'P':
+      stats = 1;
+      counters = 1;
+      break;
+    // sets the size of the input and output buffers
+    case 'b':
+      buffer_size = strtoul(optarg, NULL, 10);
+      if (buffer_size == 0) {
+        print_error();
+        return 1;
+      }
+      break;
+    // uses the framed format, and sets the number of bytes per frame
+    case 'B':
+      framed = 1;
+      frame_size = strtoul(optarg, NULL, 10);
+      if (frame_size == 0 || frame_size > MAX_FRAME) {
+        print_error();
+        return 1;
+      }
+      break;
+    // uses the framed format, and sets the number of threads that encode
+    // frames
+    case 'j':
+      framed = 1;
+      frame_threads = strtoul(optarg, NULL, 10);
+      if (frame_threads == 0 || frame_threads > MAX_THREADS) {
+        print_error();
+        return 1;
+      }
+      break;
+    // sets the number of threads that count the bytes of the infile, without
+    // changing the format
+    case 't':
+      hist_threads = strtoul(optarg, NULL, 10);
+      if (hist_threads == 0 || hist_threads > MAX_THREADS) {
+        print_error();
+        return 1;
+      }
+      break;
+    // uses the framed format, and adds a seek index after the frames
+    case 'x':
+      framed = 1;
+      seek_index = 1;
+      break;
+    // uses the framed format, and adds a checkpoint every interval bytes of
+    // each frame
+    case 'k':
+      framed = 1;
+      interval = strtoul(optarg, NULL, 10);
+      if (interval == 0) {
+        print_error();
+        return 1;
+      }
+      break;
+    // limits the length of the codes
+    case 'l':
+      limit = strtoul(optarg, NULL, 10);
+      if (limit == 0 || limit > MAX_LIMIT) {
+        print_error();
+        return 1;
+      }
+      break;
+    // uses the framed format, and splits each frame into interleaved
+    // bitstreams
+    case 's':
+      framed = 1;
+      streams = 1;
+      break;
+    // uses the framed format, and lets frames reuse the code of the last
+    // frame with a code
+    case 'R':
+      framed = 1;
+      reuse = 1;
+      break;
+    // builds the tree from a sample of the infile, so it is read only once
+    // more to encode it
+    case 'S':
+      sample = strtoull(optarg, NULL, 10);
+      if (sample == 0 || sample > MAX_SAMPLE) {
+        print_error();
+        return 1;
+      }
+      sample = sample * SAMPLE_PIECE;
+      break;
     // usage message
     case 'h':
       print_error();
@@ -82,26 +239,23 @@ int main(int argc, char **argv) {
     }
   }
 
+  // The interleaved bitstreams of a frame have no checkpoints
+  if (streams == 1 && interval != 0) {
+    fprintf(stderr, "Checkpoints (-k) can't be used with interleaved "
+                    "bitstreams (-s)\n");
+    return 1;
+  }
+
+  IO *io = io_create(buffer_size);
+  if (!io) {
+    fprintf(stderr, "Couldn't allocate %u byte buffers\n", buffer_size);
+    return 1;
+  }
   // Handle files
-  FILE *in;
+  FILE *in = stdin;
   FILE *out = stdout;
   if (give_in == 1) {
     in = fopen(input_name, "r");
-  } else {
-    // If the input file is stdin, then create a temp file. Copy all bytes from stdin to the temp file
-    in = tmpfile();
-    if (!in) {
-      fprintf(stderr,
-              "Couldn't open %s to read plaintext: No such file or directory\n",
-              input_name);
-      return 1;
-    }
-    int in_pointer = fileno(in);
-    uint8_t temp_buf;
-    while (read_bytes(0, &temp_buf, 1) > 0) {
-      write_bytes(in_pointer, &temp_buf, 1);
-    }
-    rewind(in);
   }
   if (give_out == 1) {
     out = fopen(output_name, "w");
@@ -121,19 +275,238 @@ int main(int argc, char **argv) {
   }
   int out_pointer = fileno(out);
   int in_pointer = fileno(in);
+  // Map regular files into memory, so both passes read the pages directly.
+  // Pipes and terminals can't be read twice, so they are encoded in frames in
+  // a single pass instead.
+  if (!io_map(io, in_pointer)) {
+    framed = 1;
+  }
+
+  // Creates a header
+  Header h; // = (Header *)malloc(sizeof(Header));
+  // Magic number
+  h.magic = framed == 1 ? MAGIC_FRAMED : MAGIC;
+  h.permissions = 0;
+  h.tree_size = 0;
+  h.file_size = 0;
+  // Gets information about the file
+  struct stat fstats;
+  // File permissions and size. The size of a pipe is not known in advance.
+  if (fstat(in_pointer, &fstats) == 0) {
+    h.permissions = fstats.st_mode;
+    if (fchmod(out_pointer, fstats.st_mode) != 0) {
+      fprintf(stderr, "chmod error");
+    }
+    if (S_ISREG(fstats.st_mode)) {
+      h.file_size = fstats.st_size;
+    }
+  }
+
+  uint64_t original_size = h.file_size;
+  // Times the phases of the encoding, only if statistics were asked for
+  Stats *phases = NULL;
+  if (stats == 1 && !(phases = stats_create())) {
+    fprintf(stderr, "Couldn't allocate the statistics\n");
+    return 1;
+  }
+  // Counts each phase in the hardware counters too, if the system lets us
+  if (counters == 1 && !stats_counters(phases)) {
+    fprintf(stderr, "Hardware counters are unavailable, timing only\n");
+  }
+  // The framed format (asked for, or for a pipe) encodes its frames on the
+  // -j threads, and the single-stream format counts its bytes on the -t ones
+  uint32_t threads = framed == 1 ? frame_threads : hist_threads;
+  Pool *pool = pool_create(threads);
+  if (!pool) {
+    fprintf(stderr, "Couldn't start %u threads\n", threads);
+    return 1;
+  }
+  bool ok; // set to false when the infile couldn't be fully encoded
+  if (framed == 1) {
+    ok = encode_frames(io, in_pointer, out_pointer, &h, frame_size, interval,
+                       limit, streams == 1, reuse == 1, pool, seek_index == 1,
+                       phases, &original_size);
+  } else {
+    ok = encode_single(io, in_pointer, out_pointer, &h, limit, sample, pool,
+                       phases);
+  }
+  pool_delete(&pool);
+
+  // Statistics, print the compressed file size, the decompress one, and the space saving.
+  if (stats == 1) {
+    int64_t compressed_size;
+    if (framed == 0) {
+      // The single-stream format ends with a newline that is not counted.
+      compressed_size = (double)io_bytes_written(io) - 1;
+    } else {
+      compressed_size = (double)io_bytes_written(io);
+    }
+    double space_saving =
+        100 * (1 - (compressed_size / (double)original_size));
+    if (json == 1) {
+      stats_print_json(phases, stderr, original_size, compressed_size);
+    } else {
+      fprintf(stderr,
+              "Uncompressed file size: %lu bytes\nCompressed file size: %ld "
+              "bytes\nSpace saving: %.2lf%%\n",
+              original_size, compressed_size, space_saving);
+      stats_print(phases, stderr);
+    }
+  }
+  stats_delete(&phases);
+
+  // Close for memory leaks
+  if (give_in == 1) {
+    fclose(in);
+  }
+  if (give_out == 1) {
+    fclose(out);
+  }
+  io_delete(&io);
+  // Exit with an error if the output is incomplete
+  return ok ? 0 : 1;
+}
+
+// Defines what members/fields a parallel count of the infile's bytes has.
+// Io reads the infile, whose size bytes are split into parts equal parts.
+// Hists holds the histogram of each part.
+typedef struct {
+  IO *io;
+  int infile;
+  uint64_t size;
+  uint32_t parts;
+  uint64_t (*hists)[ALPHABET];
+} Count;
 
+// Counts the bytes of part i of the infile in its own histogram. Runs on the
+// threads of the pool.
+static void count_part(void *arg, uint32_t i) {
+  Count *c = (Count *)arg;
+  uint64_t offset = c->size * i / c->parts;
+  uint64_t end = c->size * (i + 1) / c->parts;
+  // A mapped infile is counted in place, and any other is read into a buffer
+  bool mapped = io_mapped(c->io, c->infile);
+  uint64_t chunk = mapped ? MAP_CHUNK : io_buffer_size(c->io);
+  uint8_t *buf = mapped ? NULL : (uint8_t *)malloc(chunk);
+  if (!mapped && !buf) {
+    return;
+  }
+  while (offset < end) {
+    uint8_t *span;
+    int r = read_span_at(c->io, c->infile, buf,
+                         end - offset < chunk ? end - offset : chunk, offset,
+                         &span);
+    if (r <= 0) {
+      break;
+    }
+    histogram(span, r, c->hists[i]);
+    offset += r;
+  }
+  free(buf);
+}
+
+// Counts the bytes of the size bytes of the infile on the threads of the pool,
+// in parts parts that each have their own histogram, and adds them up in
+// hist. Returns false if part of the infile couldn't be read, or the memory
+// couldn't be allocated.
+static bool count_parallel(IO *io, int infile, uint64_t size, uint32_t parts,
+                           Pool *pool, uint64_t hist[static ALPHABET]) {
+  Count c = {io, infile, size, parts, NULL};
+  c.hists = (uint64_t(*)[ALPHABET])calloc(c.parts, sizeof(*c.hists));
+  if (!c.hists) {
+    return false;
+  }
+  pool_run(pool, count_part, &c, c.parts);
+  // Every byte is counted once, so the counts add up to the size unless a
+  // part was cut short
+  uint64_t total = 0;
+  for (uint32_t p = 0; p < c.parts; p += 1) {
+    for (uint32_t i = 0; i < ALPHABET; i += 1) {
+      hist[i] += c.hists[p][i];
+      total += c.hists[p][i];
+    }
+  }
+  free(c.hists);
+  return total == size;
+}
+
+// Counts the bytes of a sample of about sample bytes of the infile in hist. The
+// sample is made of pieces of SAMPLE_PIECE bytes spread evenly over the size
+// bytes of the infile, from its start to its end, so only the pieces are read.
+// A symbol that is not in the sample may still be in the infile, so every
+// symbol's count is then raised by one, which gives it a (long) code. Returns
+// false if a piece couldn't be read, or the memory couldn't be allocated.
+static bool count_sample(IO *io, int infile, uint64_t size, uint64_t sample,
+                         uint64_t hist[static ALPHABET]) {
+  uint64_t pieces = (sample + SAMPLE_PIECE - 1) / SAMPLE_PIECE;
+  bool mapped = io_mapped(io, infile);
+  uint8_t *buf = mapped ? NULL : (uint8_t *)malloc(SAMPLE_PIECE);
+  if (!mapped && !buf) {
+    return false;
+  }
+  bool ok = true;
+  for (uint64_t k = 0; ok && k < pieces; k += 1) {
+    // The first piece starts at the start of the infile, and the last one
+    // ends at its end
+    uint64_t offset =
+        pieces == 1 ? 0 : (size - SAMPLE_PIECE) / (pieces - 1) * k;
+    uint8_t *span;
+    int r = read_span_at(io, infile, buf, SAMPLE_PIECE, offset, &span);
+    ok = r == SAMPLE_PIECE;
+    histogram(span, ok ? r : 0, hist);
+  }
+  free(buf);
+  for (uint64_t i = 0; i < ALPHABET; i += 1) {
+    hist[i] += 1;
+  }
+  return ok;
+}
+
+// Compresses the infile as a single Huffman stream: the header, the dump of a
+// tree built from the histogram of the whole infile, the code of every byte
+// and a final newline. The infile is read twice, so it must be mapped or
+// seekable. Takes the header h with its magic, permissions and file size set.
+// If limit is not 0, no code is longer than limit bits. When the pool has
+// more than one thread and the infile is large, the first pass (which only
+// counts the bytes) is split over the threads. The output is the same. If
+// sample is not 0 and the infile is larger, the tree is built from a sample
+// of about sample bytes instead (see count_sample), so the first pass only
+// reads the sample, at the cost of a slightly worse compression ratio. Each
+// phase is timed in stats, unless it is NULL. Returns true to indicate
+// success, false if the infile couldn't be read, the outfile couldn't be
+// written or the memory couldn't be allocated.
+bool encode_single(IO *io, int infile, int outfile, Header *h,
+                   uint32_t limit, uint64_t sample, Pool *pool, Stats *stats) {
   // Create a histogram by reading files
   // Set intial values of all characters to 0
   uint64_t hist[ALPHABET];
   for (uint64_t i = 0; i < ALPHABET; i += 1) {
     hist[i] = 0;
   }
-  // Read in a byte from infile until reaching the end of the file.
+  stats_start(stats, io, PHASE_HISTOGRAM);
+  uint64_t counted_bytes = io_bytes_read(io);
+  // One part per thread, but each part gets at least HIST_SPLIT bytes, or the
+  // threads cost more than they save
+  uint64_t parts = h->file_size / HIST_SPLIT;
+  parts = parts < pool_threads(pool) ? parts : pool_threads(pool);
+  bool counted = false;
+  if (sample != 0 && h->file_size > sample) {
+    counted = count_sample(io, infile, h->file_size, sample, hist);
+  } else if (parts > 1) {
+    counted = count_parallel(io, infile, h->file_size, parts, pool, hist);
+  }
+  if (!counted) {
+    for (uint64_t i = 0; i < ALPHABET; i += 1) {
+      hist[i] = 0;
+    }
+  }
+  // Read in a block from infile until reaching the end of the file.
   // Increase the frequency of the corrasponding character in the histogram
   // array
-  uint8_t buf = 0;
-  while (read_bytes(in_pointer, &buf, 1) > 0) {
-    hist[buf] += 1;
+  uint8_t *block;
+  int r;
+  while (!counted && (r = read_block(io, infile, &block)) > 0) {
+    histogram(block, r, hist);
   }
   // Ensure that the histogram has at least 2 non-zero values
   if (hist[0] == 0) {
@@ -142,80 +515,314 @@ int main(int argc, char **argv) {
   if (hist[1] == 0) {
     hist[1] = 1;
   }
+  stats_stop(stats, io, PHASE_HISTOGRAM, io_bytes_read(io) - counted_bytes);
 
-  // Builds a Huffman tree using the histogram, and find its root.
-  Node *root = build_tree(hist);
+  // Builds a Huffman tree using the histogram, and find its root. All the
+  // Nodes live in one arena, so the tree is freed at once at the end.
+  stats_start(stats, io, PHASE_TREE);
+  Arena *a = arena_create();
+  if (!a) {
+    fprintf(stderr, "Couldn't allocate the tree\n");
+    return false;
+  }
+  Node *root = build_tree(a, hist);
+  // If a code is too long, replace the tree with the tree of the canonical
+  // length-limited codes. It is stored as a tree dump like any other tree, so
+  // the format doesn't change.
+  if (limit != 0) {
+    uint8_t lengths[ALPHABET];
+    canonical_lengths(root, lengths);
+    uint32_t longest = 0;
+    for (uint64_t i = 0; i < ALPHABET; i += 1) {
+      longest = lengths[i] > longest ? lengths[i] : longest;
+    }
+    if (longest > limit) {
+      // The lengths are all that is left of the old tree, so the arena can
+      // hold the new one
+      bool limited = canonical_limit(hist, limit, lengths);
+      if (limited) {
+        arena_reset(a);
+        root = canonical_tree(a, lengths);
+        limited = root != NULL;
+      }
+      if (!limited) {
+        fprintf(stderr, "Couldn't limit the codes to %u bits\n", limit);
+        arena_reset(a);
+        root = build_tree(a, hist);
+      }
+    }
+  }
+  stats_stop(stats, io, PHASE_TREE, 0);
   // Creates a code table
+  stats_start(stats, io, PHASE_CODES);
   Code table[ALPHABET];
   for (uint64_t i = 0; i < ALPHABET; i += 1) {
     table[i] = code_init();
   }
   build_codes(root, table);
-
-  // Creates a header
-  Header h; // = (Header *)malloc(sizeof(Header));
-  // Magic number
-  h.magic = MAGIC;
-  // Gets information about the file
-  struct stat fstats;
-  // File permissions and size
-  if (fstat(in_pointer, &fstats) == 0) {
-    h.permissions = fstats.st_mode;
-    if (fchmod(out_pointer, fstats.st_mode) != 0) {
-      fprintf(stderr, "chmod error");
+  // Packs each code into a single word, so that writing a symbol is one shift
+  // and OR instead of a loop over its bits.
+  PackedCode packed[ALPHABET];
+  bool long_codes = false;
+  for (uint64_t i = 0; i < ALPHABET; i += 1) {
+    packed[i] = code_pack(&table[i]);
+    if (code_size(&table[i]) > 64) {
+      long_codes = true;
     }
-    h.file_size = fstats.st_size;
   }
+  stats_stop(stats, io, PHASE_CODES, 0);
+
   // Tree size
-  h.tree_size = 0;
+  stats_start(stats, io, PHASE_HEADER);
+  uint64_t written = io_bytes_written(io);
+  h->tree_size = 0;
   for (uint64_t i = 0; i < ALPHABET; i += 1) {
     if (hist[i] > 0) {
-      h.tree_size += 1;
+      h->tree_size += 1;
     }
   }
-  h.tree_size = h.tree_size * 3 - 1;
+  h->tree_size = h->tree_size * 3 - 1;
 
   // Convert the header to an array of 8bits, and write header to outfile.
-  uint8_t *buff = (uint8_t *)&h;
-  write_bytes(out_pointer, buff, sizeof(h));
-  dump_tree(out_pointer, root);
+  uint8_t *buff = (uint8_t *)h;
+  write_bytes(io, outfile, buff, sizeof(Header));
+  dump_tree(io, outfile, root);
+  stats_stop(stats, io, PHASE_HEADER, io_bytes_written(io) - written);
   // Read from the beginning of infile, and write the symbol for each character
-  lseek(fileno(in), 0, SEEK_SET);
-  while (read_bytes(in_pointer, &buf, 1) > 0) {
-    write_code(out_pointer, &table[buf]);
+  stats_start(stats, io, PHASE_ENCODE);
+  uint64_t encoded_bytes = io_bytes_read(io);
+  io_rewind(io, infile);
+  while ((r = read_block(io, infile, &block)) > 0) {
+    for (int i = 0; i < r; i += 1) {
+      // Codes longer than a word only happen for huge, very skewed inputs
+      if (long_codes && code_size(&table[block[i]]) > 64) {
+        write_code(io, outfile, &table[block[i]]);
+      } else {
+        write_bits(io, outfile, packed[block[i]].bits,
+                   packed[block[i]].length);
+      }
+    }
   }
-  flush_codes(out_pointer);
-  buf = '\n';
-  write_bytes(out_pointer, &buf, 1);
+  stats_stop(stats, io, PHASE_ENCODE, io_bytes_read(io) - encoded_bytes);
+  stats_start(stats, io, PHASE_FLUSH);
+  written = io_bytes_written(io);
+  flush_codes(io, outfile);
+  uint8_t buf = '\n';
+  write_bytes(io, outfile, &buf, 1);
+  stats_stop(stats, io, PHASE_FLUSH, io_bytes_written(io) - written);
 
-  // Statistics, print the compressed file size, the decompress one, and the space saving.
-  if (stats == 1) {
-    extern uint64_t bytes_written;
-    int64_t compressed_size;
-    if (give_in == 1) {
-      compressed_size = (double)bytes_written - 1;
-    } else {
-      // Since we are using write_bytes to copy from stdin to the temp file, need to remove the size of the file from bytes written.
-      compressed_size = (double)bytes_written - 1 - (h.file_size);
+  // Delete for memory leaks
+  arena_delete(&a);
+  if (io_failed(io)) {
+    fprintf(stderr, "Couldn't read the infile or write the outfile\n");
+    return false;
+  }
+  return true;
+}
+
+// Defines what members/fields a slot of a batch of frames has.
+// Span points at the bytes of the frame and size is their number.
+// Interval is the number of bytes between checkpoints, or 0 for none, and
+// limit is the longest code in bits, or 0 for no limit. Streams is set for
+// frames with interleaved bitstreams.
+// Hist is the histogram of the frame's bytes, lengths are the code lengths
+// of its own code, coded is set once they are found, and reuse is set when
+// the frame uses the code of the last frame with a code instead.
+// Frame is the encoded frame and frame_size is its number of bytes.
+typedef struct {
+  uint8_t *span;
+  uint32_t size;
+  uint32_t interval;
+  uint32_t limit;
+  bool streams;
+  uint64_t hist[ALPHABET];
+  uint8_t lengths[ALPHABET];
+  bool coded;
+  bool reuse;
+  uint8_t *frame;
+  uint64_t frame_size;
+} Slot;
+
+// Finds the code of the frame in slot i of the batch. Runs on the threads of
+// the pool.
+static void code_slot(void *arg, uint32_t i) {
+  Slot *slots = (Slot *)arg;
+  slots[i].coded = frame_code(slots[i].span, slots[i].size, slots[i].limit,
+                              slots[i].hist, slots[i].lengths);
+}
+
+// Encodes the frame in slot i of the batch with the code found by code_slot.
+// Runs on the threads of the pool.
+static void encode_slot(void *arg, uint32_t i) {
+  Slot *slots = (Slot *)arg;
+  slots[i].frame_size = 0;
+  if (slots[i].coded) {
+    slots[i].frame_size = frame_write(
+        slots[i].span, slots[i].size, slots[i].interval, slots[i].streams,
+        slots[i].hist, slots[i].lengths, slots[i].reuse, &slots[i].frame);
+  }
+}
+
+// Compresses the infile in the framed format: the header, followed by a frame
+// for every frame_size bytes of the infile and an empty frame that marks the
+// end. The frames are read in batches, the frames of a batch are encoded on
+// the threads of the pool, and then they are written in order. Every frame
+// only depends on its own bytes, so the output is the same for any number of
+// threads. Only one batch of the infile is in memory at a time, so the infile
+// is read once and can be a pipe. If index is set, the frames are followed by
+// a seek index with the offset of each frame and of its first decoded byte,
+// so the decoder can find the frames without reading them in order. If
+// interval isn't 0, each frame gets a checkpoint every interval bytes, so a
+// range of bytes can be decoded without decoding the frame from its start. If
+// limit isn't 0, no code is longer than limit bits. If streams is set, each
+// frame is split into STREAMS interleaved bitstreams. If reuse is set, a frame
+// whose own code would save less than REUSE_MIN bytes over the code of the
+// last frame with a code uses that code instead (see frame_reuse). Which
+// frames do is decided in order, between finding the codes and writing the
+// frames on the threads, so it doesn't depend on the threads either. Takes the
+// header h with its magic, permissions and file size set. Each phase is timed
+// in stats, unless it is NULL. The number of bytes read from the infile is
+// stored in encoded. Returns true to indicate success, false if the infile
+// couldn't be read, the outfile couldn't be written or the memory couldn't be
+// allocated. Then the end of the frames is not written, so the output can't
+// pass for a complete, shorter file.
+bool encode_frames(IO *io, int infile, int outfile, Header *h,
+                   uint32_t frame_size, uint32_t interval, uint32_t limit,
+                   bool streams, bool reuse, Pool *pool, bool index,
+                   Stats *stats, uint64_t *encoded) {
+  *encoded = 0;
+  write_bytes(io, outfile, (uint8_t *)h, sizeof(Header));
+  uint64_t offset = sizeof(Header);
+  IndexEntry *entries = NULL;
+  uint32_t count_entries = 0;
+  uint32_t capacity = 0;
+  // A single thread encodes one frame at a time. More threads get two frames
+  // each per batch, so a slow frame doesn't leave the others waiting.
+  uint32_t batch = pool_threads(pool) == 1 ? 1 : 2 * pool_threads(pool);
+  uint8_t *data = (uint8_t *)malloc((uint64_t)batch * frame_size);
+  Slot *slots = (Slot *)calloc(batch, sizeof(Slot));
+  if (!data || !slots) {
+    fprintf(stderr, "Couldn't allocate %u frames of %u bytes\n", batch,
+            frame_size);
+    free(data);
+    free(slots);
+    return false;
+  }
+  // The code lengths of the last frame with a code, once there is one
+  uint8_t previous[ALPHABET];
+  bool has_previous = false;
+  uint64_t total = 0;
+  bool ok = true;
+  while (ok) {
+    // Read the next batch of frames
+    stats_start(stats, io, PHASE_READ);
+    uint64_t batch_bytes = 0;
+    uint32_t count = 0;
+    int r;
+    while (count < batch &&
+           (r = read_span(io, infile, &data[(uint64_t)count * frame_size],
+                          frame_size, &slots[count].span)) > 0) {
+      slots[count].size = r;
+      slots[count].interval = interval;
+      slots[count].limit = limit;
+      slots[count].streams = streams;
+      batch_bytes += r;
+      count += 1;
     }
-    double space_saving = 100 * (1 - (compressed_size / (double)h.file_size));
-    fprintf(stderr,
-            "Uncompressed file size: %lu bytes\nCompressed file size: %ld "
-            "bytes\nSpace saving: %.2lf%%\n",
-            h.file_size, compressed_size, space_saving);
-  }
-  
-  // Delete and close for memory leaks
-  delete_tree(&root);
-  fclose(in);
-  if (give_out == 1) {
-    fclose(out);
+    stats_stop(stats, io, PHASE_READ, batch_bytes);
+    // read_span stops at a failed read as at the end of the infile, so the
+    // IO tells them apart
+    if (io_failed(io)) {
+      fprintf(stderr, "Couldn't read the infile or write the outfile\n");
+      ok = false;
+    }
+    if (count == 0 || !ok) {
+      break;
+    }
+    // Find the codes of the batch, decide in order which frames reuse the
+    // last code, then encode the batch, and write its frames in order
+    stats_start(stats, io, PHASE_HISTOGRAM);
+    pool_run(pool, code_slot, slots, count);
+    for (uint32_t i = 0; i < count; i += 1) {
+      slots[i].reuse = reuse && has_previous && slots[i].coded &&
+                       frame_reuse(slots[i].hist, slots[i].lengths, previous);
+      if (slots[i].reuse) {
+        memcpy(slots[i].lengths, previous, ALPHABET);
+      } else if (slots[i].coded) {
+        memcpy(previous, slots[i].lengths, ALPHABET);
+        has_previous = true;
+      }
+    }
+    stats_stop(stats, io, PHASE_HISTOGRAM, batch_bytes);
+    stats_start(stats, io, PHASE_ENCODE);
+    pool_run(pool, encode_slot, slots, count);
+    stats_stop(stats, io, PHASE_ENCODE, batch_bytes);
+    stats_start(stats, io, PHASE_WRITE);
+    uint64_t written = io_bytes_written(io);
+    for (uint32_t i = 0; i < count; i += 1) {
+      if (slots[i].frame_size == 0) {
+        fprintf(stderr, "Couldn't allocate a %u byte frame\n", frame_size);
+        ok = false;
+      } else if (ok) {
+        // Remember where the frame starts, growing the index as needed
+        if (index && count_entries == capacity) {
+          capacity = capacity == 0 ? 64 : 2 * capacity;
+          IndexEntry *bigger = (IndexEntry *)realloc(
+              entries, (uint64_t)capacity * sizeof(IndexEntry));
+          if (!bigger) {
+            fprintf(stderr, "Couldn't allocate the seek index\n");
+            index = false;
+          }
+          entries = bigger ? bigger : entries;
+        }
+        if (index) {
+          entries[count_entries].offset = offset;
+          entries[count_entries].symbol = total;
+          count_entries += 1;
+        }
+        write_bytes(io, outfile, slots[i].frame, slots[i].frame_size);
+        offset += slots[i].frame_size;
+        total += slots[i].size;
+      }
+      free(slots[i].frame);
+      slots[i].frame = NULL;
+    }
+    stats_stop(stats, io, PHASE_WRITE, io_bytes_written(io) - written);
   }
-  return 0;
+  *encoded = total;
+  if (!ok) {
+    free(entries);
+    free(slots);
+    free(data);
+    return false;
+  }
+  // An empty frame marks the end of the frames
+  stats_start(stats, io, PHASE_FLUSH);
+  uint64_t written = io_bytes_written(io);
+  Frame end = {0, 0, 0, 0};
+  write_bytes(io, outfile, (uint8_t *)&end, sizeof(Frame));
+  // The seek index ends with a Trailer, so it can be found from the end of the
+  // file
+  if (index) {
+    write_bytes(io, outfile, (uint8_t *)entries,
+                (uint64_t)count_entries * sizeof(IndexEntry));
+    Trailer t = {total, count_entries, MAGIC_INDEX};
+    write_bytes(io, outfile, (uint8_t *)&t, sizeof(Trailer));
+  }
+  stats_stop(stats, io, PHASE_FLUSH, io_bytes_written(io) - written);
+  free(entries);
+  free(slots);
+  free(data);
+  if (io_failed(io)) {
+    fprintf(stderr, "Couldn't read the infile or write the outfile\n");
+    return false;
+  }
+  return true;
 }
 
 // TESTS FOR EACH FILE
 void huffman_test(int outfile) {
+  IO *io = io_create(BLOCK);
   uint64_t hist[ALPHABET];
   static Code table[ALPHABET];
   for (uint64_t i = 0; i < ALPHABET; i += 1) {
@@ -231,23 +838,27 @@ void huffman_test(int outfile) {
   hist['d'] = 2;
   hist['e'] = 4;
   hist['f'] = 1;
-  Node *root = build_tree(hist);
+  Arena *a = arena_create();
+  Node *root = build_tree(a, hist);
   build_codes(root, table);
   printf("tree dump\n");
-  dump_tree(outfile, root);
+  dump_tree(io, outfile, root);
   printf("codes\n");
   for (uint8_t i = 'a'; i < 'g'; i += 1) {
     code_print(&table[i]);
   }
   printf("write code\n");
   for (uint8_t i = 'a'; i < 'g'; i += 1) {
-    write_code(outfile, &table[i]);
+    write_code(io, outfile, &table[i]);
   }
-  flush_codes(outfile);
+  flush_codes(io, outfile);
+  arena_delete(&a);
+  io_delete(&io);
 }
 
 void io_test(int infile, int outfile) {
   printf("-----------IO TEST--------\n");
+  IO *io = io_create(BLOCK);
 
   // printf("infile is %d\n", infile);
   int size = 40;
@@ -255,21 +866,22 @@ void io_test(int infile, int outfile) {
   for (int i = 0; i < size; i += 1) {
     buf[i] = 0;
   }
-  read_bytes(infile, buf, size);
+  read_bytes(io, infile, buf, size);
   /*for (int i=0; i<size; i+=1) {
           printf("byte is %d\n", buf[i]);
   }*/
-  write_bytes(outfile, buf, size + 5);
+  write_bytes(io, outfile, buf, size + 5);
   uint8_t bit = 0;
-  while (read_bit(infile, &bit)) {
+  while (read_bit(io, infile, &bit)) {
 
     printf("bit is %d\n", bit);
-  } /*
+  }
+  io_delete(&io); /*
    Code c = code_init();
    code_push_bit(&c, 1);
    code_push_bit(&c, 1);
    code_push_bit(&c, 0);
-   write_code(outfile, &c);*/
+   write_code(io, outfile, &c);*/
 }
 
 void pq_test(void) {
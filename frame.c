@@ -0,0 +1,793 @@
+#include "frame.h"
+#include "canonical.h"
+#include "code.h"
+#include "decoder.h"
+#include "defines.h"
+#include "header.h"
+#include "histogram.h"
+#include "huffman.h"
+#include "io.h"
+#include "memstats.h"
+#include "node.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Goal: encode and decode the frames of the framed format. The input is split
+// into frames of a bounded number of bytes, and each frame has its own
+// histogram, Huffman tree and bitstream. That way a frame can be encoded as
+// soon as its bytes are read, without reading the whole input first.
+// A frame is made of a Frame header, the frame's code and the frame's payload.
+// A Frame with 0 symbols marks the end of the frames. When the
+// FRAME_CANONICAL flag is set, the code is stored as the length of each
+// symbol's canonical code (see canonical.c), and otherwise as the dump of the
+// frame's tree. The encoder always stores canonical codes.
+// The payload is the frame's bitstream. When the FRAME_CHECKPOINTS flag is
+// set, the payload starts with a checkpoint table instead: the checkpoint
+// interval and the number of checkpoints (32 bits each), and the 64-bit bit
+// offset in the bitstream of every interval-th symbol after the first one.
+// The bitstream follows the table. Checkpoints let a reader start decoding in
+// the middle of a frame.
+// When the FRAME_STREAMS flag is set instead, the frame's symbols are split
+// into STREAMS parts of (symbols + STREAMS - 1) / STREAMS symbols (the last
+// one gets the rest), and each part has its own bitstream. The payload starts
+// with a jump table of the byte sizes of the first STREAMS - 1 bitstreams (32
+// bits each), followed by the bitstreams in order. The last one takes the rest
+// of the payload. The decoder reads all of them in the same loop (see
+// decoder_decode_streams). Such frames have no checkpoints.
+// When the FRAME_REUSE flag is set, the frame has no code (its tree_size is 0)
+// and uses the code of the last frame before it that has one. The encoder only
+// does that when the frame's own code, counting the bytes to store it, would
+// save less than REUSE_MIN bytes (see frame_reuse).
+
+// Stores the 64 bits of word to out, with the lowest bits in the first byte.
+static void store_word(uint8_t *out, uint64_t word) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  memcpy(out, &word, sizeof(word));
+}
+
+// Writes the code of each of the n bytes of data to out, using a 64-bit bit
+// buffer that is stored a word at a time. Out must have 8 bytes of room past
+// the end of the bitstream. If interval is not 0, the bit offset of every
+// interval-th symbol after the first one is stored in checkpoints. Returns the
+// number of bits in the bitstream.
+static uint64_t write_payload(uint8_t *out, const uint8_t *data, uint32_t n,
+                              PackedCode packed[static ALPHABET],
+                              uint32_t interval, uint64_t *checkpoints) {
+  uint64_t bit_buffer = 0;
+  uint32_t bit_count = 0;
+  uint64_t index = 0;
+  uint32_t step = interval == 0 ? n : interval;
+  for (uint32_t start = 0; start < n; start += step) {
+    // The bits stored so far plus the bits in the buffer
+    if (start > 0) {
+      checkpoints[start / step - 1] = 8 * index + bit_count;
+    }
+    uint32_t end = n - start < step ? n : start + step;
+    for (uint32_t i = start; i < end; i += 1) {
+      PackedCode p = packed[data[i]];
+      bit_buffer |= p.bits << bit_count;
+      if (bit_count + p.length < 64) {
+        bit_count += p.length;
+      } else {
+        // The buffer is full: store it, and keep the bits that didn't fit
+        store_word(&out[index], bit_buffer);
+        index += 8;
+        bit_buffer = bit_count == 0 ? 0 : p.bits >> (64 - bit_count);
+        bit_count = bit_count + p.length - 64;
+      }
+    }
+  }
+  // The bits above bit_count are 0, so the last byte is padded with 0 bits
+  store_word(&out[index], bit_buffer);
+  return 8 * index + bit_count;
+}
+
+// Writes the n bytes of data as STREAMS bitstreams after a jump table, to out
+// (see the Goal). Out must have room for the table, the bitstreams with each
+// one's last byte padded, and 8 more bytes. Returns the number of bytes
+// written.
+static uint32_t write_streams(uint8_t *out, const uint8_t *data, uint32_t n,
+                              PackedCode packed[static ALPHABET]) {
+  uint32_t q = n / STREAMS + (n % STREAMS != 0);
+  uint32_t size = 4 * (STREAMS - 1);
+  for (uint32_t j = 0; j < STREAMS; j += 1) {
+    uint32_t first = j * q < n ? j * q : n;
+    uint32_t last = (j + 1) * q < n ? (j + 1) * q : n;
+    uint32_t bytes =
+        (write_payload(&out[size], &data[first], last - first, packed, 0,
+                       NULL) +
+         7) /
+        8;
+    if (j < STREAMS - 1) {
+      memcpy(&out[4 * j], &bytes, 4);
+    }
+    size += bytes;
+  }
+  return size;
+}
+
+// Finds the code of a frame of the n bytes of data: sets hist to the
+// histogram of the bytes, and lengths to the length of each symbol's canonical
+// Huffman code. If limit is not 0, no code is longer than limit bits (or the
+// fewest bits that fit all the frame's symbols, if that is more). Returns
+// false if the memory couldn't be allocated.
+bool frame_code(const uint8_t *data, uint32_t n, uint32_t limit,
+                uint64_t hist[static ALPHABET],
+                uint8_t lengths[static ALPHABET]) {
+  // Create a histogram of the frame's bytes
+  for (uint64_t i = 0; i < ALPHABET; i += 1) {
+    hist[i] = 0;
+  }
+  histogram(data, n, hist);
+  // Ensure that the tree has at least 2 leaves, without changing hist, which
+  // is used to find the size of the bitstream (see frame_write)
+  uint64_t freq[ALPHABET];
+  memcpy(freq, hist, sizeof(freq));
+  if (freq[0] == 0) {
+    freq[0] = 1;
+  }
+  if (freq[1] == 0) {
+    freq[1] = 1;
+  }
+
+  // Finds the length of each Huffman code, without building a tree of Nodes.
+  // The frame uses the canonical codes of those lengths. A frame has at most
+  // MAX_FRAME bytes, so no code can be longer than 64 bits.
+  build_lengths(freq, lengths);
+  // Only codes that are too long need the slower length-limited code
+  uint32_t longest = 0;
+  for (uint64_t i = 0; i < ALPHABET; i += 1) {
+    longest = lengths[i] > longest ? lengths[i] : longest;
+  }
+  return limit == 0 || longest <= limit ||
+         canonical_limit(freq, limit, lengths);
+}
+
+// Decides if a frame whose bytes have the histogram hist should reuse the code
+// of the last frame with a code, whose code lengths are previous, instead of
+// storing its own code lengths. The cost of each code is the sum of the
+// histogram times the code lengths, and the frame's own code also costs the
+// bytes that store it. Returns true if its own code would save less than
+// REUSE_MIN bytes, and false if it saves more or previous has no code for one
+// of the frame's bytes.
+bool frame_reuse(uint64_t hist[static ALPHABET],
+                 uint8_t lengths[static ALPHABET],
+                 uint8_t previous[static ALPHABET]) {
+  uint64_t own = 0;
+  uint64_t reused = 0;
+  for (uint64_t i = 0; i < ALPHABET; i += 1) {
+    if (hist[i] != 0 && previous[i] == 0) {
+      return false;
+    }
+    own += hist[i] * lengths[i];
+    reused += hist[i] * previous[i];
+  }
+  uint8_t code[MAX_TREE_SIZE];
+  own += 8 * (uint64_t)canonical_dump(lengths, code);
+  return reused < own + 8 * REUSE_MIN;
+}
+
+// Encodes the n bytes of data, whose histogram is hist, as a single frame with
+// the canonical codes of the lengths (see frame_code). If reuse is true, the
+// lengths are those of the last frame with a code, and the frame doesn't store
+// them. If interval is not 0, the frame gets a checkpoint every interval
+// symbols. If streams is true, the frame has STREAMS interleaved bitstreams and
+// no checkpoints, whatever the interval. Allocates the frame argument and
+// fills it with the frame, which the caller must free. Returns the number of
+// bytes in the frame, or 0 if the memory couldn't be allocated.
+uint64_t frame_write(const uint8_t *data, uint32_t n, uint32_t interval,
+                     bool streams, uint64_t hist[static ALPHABET],
+                     uint8_t lengths[static ALPHABET], bool reuse,
+                     uint8_t **frame) {
+  if (streams) {
+    interval = 0;
+  }
+  PackedCode packed[ALPHABET];
+  canonical_codes(lengths, packed);
+  uint64_t bits = 0;
+  for (uint64_t i = 0; i < ALPHABET; i += 1) {
+    bits += hist[i] * packed[i].length;
+  }
+  // The checkpoint table has the interval, the number of checkpoints and
+  // their bit offsets
+  uint32_t count = interval == 0 ? 0 : (n - 1) / interval;
+  uint32_t table_size = interval == 0 ? 0 : 8 + 8 * count;
+  uint32_t payload_size = table_size + (bits + 7) / 8;
+  // Each bitstream has its own padding, and their sizes are in the jump table
+  if (streams) {
+    payload_size += STREAMS + 4 * (STREAMS - 1);
+  }
+
+  // The frame is the Frame header, the code lengths and the payload, plus room
+  // for the last word of the bitstream
+  *frame = (uint8_t *)malloc(sizeof(Frame) + MAX_TREE_SIZE + payload_size + 8);
+  uint64_t *checkpoints = (uint64_t *)malloc(8 * count + 8);
+  if (!*frame || !checkpoints) {
+    free(*frame);
+    *frame = NULL;
+    free(checkpoints);
+    return 0;
+  }
+  Frame f;
+  f.symbols = n;
+  f.payload_size = payload_size;
+  f.tree_size =
+      reuse ? 0 : canonical_dump(lengths, &(*frame)[sizeof(Frame)]);
+  f.flags = (reuse ? FRAME_REUSE : FRAME_CANONICAL) |
+            (interval == 0 ? 0 : FRAME_CHECKPOINTS) |
+            (streams ? FRAME_STREAMS : 0);
+  uint8_t *payload = &(*frame)[sizeof(Frame) + f.tree_size];
+  if (streams) {
+    f.payload_size = write_streams(payload, data, n, packed);
+  } else {
+    write_payload(&payload[table_size], data, n, packed, interval,
+                  checkpoints);
+  }
+  memcpy(*frame, &f, sizeof(Frame));
+  if (interval != 0) {
+    memcpy(&payload[0], &interval, 4);
+    memcpy(&payload[4], &count, 4);
+    memcpy(&payload[8], checkpoints, 8 * count);
+  }
+  free(checkpoints);
+  return sizeof(Frame) + f.tree_size + f.payload_size;
+}
+
+// Encodes the n bytes of data as a single frame with its own code (see
+// frame_code and frame_write). Allocates the frame argument and fills it with
+// the frame, which the caller must free. Returns the number of bytes in the
+// frame, or 0 if the memory couldn't be allocated.
+uint64_t frame_encode(const uint8_t *data, uint32_t n, uint32_t interval,
+                      uint32_t limit, bool streams, uint8_t **frame) {
+  uint64_t hist[ALPHABET];
+  uint8_t lengths[ALPHABET];
+  if (!frame_code(data, n, limit, hist, lengths)) {
+    *frame = NULL;
+    return 0;
+  }
+  return frame_write(data, n, interval, streams, hist, lengths, false, frame);
+}
+
+// Reads the checkpoint table at the start of a frame's payload, and sets
+// interval and count to the checkpoint interval and number of checkpoints.
+// Returns the size of the table, which is 0 when the frame has no
+// checkpoints, or more than the payload size if the table is invalid.
+static uint64_t read_checkpoints(Frame *f, const uint8_t *payload,
+                                 uint32_t *interval, uint32_t *count) {
+  *interval = 0;
+  *count = 0;
+  if (!(f->flags & FRAME_CHECKPOINTS)) {
+    return 0;
+  }
+  if (f->payload_size < 8) {
+    return (uint64_t)f->payload_size + 1;
+  }
+  memcpy(interval, &payload[0], 4);
+  memcpy(count, &payload[4], 4);
+  return 8 + 8 * (uint64_t)*count;
+}
+
+// Builds the decoder for a frame from its code lengths, or from the dump of its
+// tree for frames without canonical codes. Returns NULL if the lengths or the
+// tree are invalid, the frame has no code of its own (FRAME_REUSE), or the
+// memory couldn't be allocated.
+static Decoder *frame_decoder(Frame *f, const uint8_t *tree) {
+  if (f->tree_size > MAX_TREE_SIZE || (f->flags & FRAME_REUSE)) {
+    return NULL;
+  }
+  if (f->flags & FRAME_CANONICAL) {
+    uint8_t lengths[ALPHABET];
+    if (!canonical_load(f->tree_size, tree, lengths)) {
+      return NULL;
+    }
+    return decoder_create_lengths(lengths);
+  }
+  FlatTree t;
+  if (!rebuild_tree(f->tree_size, tree, &t)) {
+    return NULL;
+  }
+  return decoder_create(&t);
+}
+
+// Gets the decoder for the frame f, whose code is tree, when the frames are
+// decoded in order. Last is the decoder of the last frame with a code: a frame
+// with FRAME_REUSE uses it, and any other frame builds its own decoder, which
+// takes its place. The caller deletes last after the last frame. Returns NULL
+// if the frame has no code to use or its decoder can't be built.
+static Decoder *next_decoder(Frame *f, const uint8_t *tree,
+                             Decoder **last) {
+  if (f->flags & FRAME_REUSE) {
+    return f->tree_size == 0 ? *last : NULL;
+  }
+  Decoder *d = frame_decoder(f, tree);
+  if (d) {
+    decoder_delete(last);
+    *last = d;
+  }
+  return d;
+}
+
+// Builds the decoder of the code of frame i of the index (see frame_index).
+// Only the Frame header and the code are read, with read_span_at, so any
+// thread can call it. Returns NULL if the frame has no code of its own, the
+// code is invalid or the memory couldn't be allocated.
+static Decoder *frame_decoder_at(IO *io, int infile, FrameEntry *index,
+                                 uint32_t i) {
+  Frame f;
+  uint8_t *span;
+  if (read_span_at(io, infile, (uint8_t *)&f, sizeof(Frame), index[i].offset,
+                   &span) != sizeof(Frame)) {
+    return NULL;
+  }
+  memmove(&f, span, sizeof(Frame));
+  uint8_t tree[MAX_TREE_SIZE];
+  if (f.tree_size > MAX_TREE_SIZE ||
+      read_span_at(io, infile, tree, f.tree_size,
+                   index[i].offset + sizeof(Frame), &span) != f.tree_size) {
+    return NULL;
+  }
+  return frame_decoder(&f, span);
+}
+
+// Decodes the STREAMS interleaved bitstreams of the payload of the frame f with
+// the decoder d, to out, which has room for f->symbols bytes. Returns true to
+// indicate success, false otherwise.
+static bool decode_streams(Decoder *d, Frame *f, const uint8_t *payload,
+                           uint8_t *out) {
+  uint32_t table = 4 * (STREAMS - 1);
+  if (f->payload_size < table) {
+    return false;
+  }
+  const uint8_t *streams[STREAMS];
+  uint32_t sizes[STREAMS];
+  uint32_t left = f->payload_size - table;
+  streams[0] = &payload[table];
+  for (uint32_t j = 0; j < STREAMS - 1; j += 1) {
+    memcpy(&sizes[j], &payload[4 * j], 4);
+    if (sizes[j] > left) {
+      return false;
+    }
+    left -= sizes[j];
+    streams[j + 1] = streams[j] + sizes[j];
+  }
+  sizes[STREAMS - 1] = left;
+  return decoder_decode_streams(d, streams, sizes, out, f->symbols);
+}
+
+// Sets the decoder d to decode the bitstream of a frame from its first symbol,
+// skipping the checkpoint table of the payload. Returns false if the table is
+// invalid.
+static bool start_bitstream(Decoder *d, Frame *f, const uint8_t *payload) {
+  uint32_t interval;
+  uint32_t count;
+  uint64_t skip = read_checkpoints(f, payload, &interval, &count);
+  if (skip > f->payload_size) {
+    return false;
+  }
+  decoder_reset(d, &payload[skip], f->payload_size - skip);
+  return true;
+}
+
+// Decodes the frame whose Frame header f was just read from the infile with
+// the io. Reads the frame's tree and bitstream, and writes the decoded bytes
+// to the outfile, out_size bytes at a time using the out buffer. Last holds
+// the decoder of the last frame with a code (see next_decoder), and starts as
+// NULL. Returns true to indicate success, false otherwise.
+bool frame_decode(IO *io, int infile, int outfile, Frame *f, Decoder **last,
+                  uint8_t *out, uint32_t out_size) {
+  // Gets the dumped tree, and builds the frame's decode table
+  uint8_t tree[MAX_TREE_SIZE];
+  if (f->tree_size > MAX_TREE_SIZE ||
+      read_bytes(io, infile, tree, f->tree_size) != f->tree_size) {
+    return false;
+  }
+  Decoder *d = next_decoder(f, tree, last);
+  // Gets the bitstream. A mapped infile is decoded in place.
+  uint8_t *buf = (uint8_t *)malloc(f->payload_size);
+  if (!d || !buf) {
+    free(buf);
+    return false;
+  }
+  uint8_t *payload;
+  bool ok = read_span(io, infile, buf, f->payload_size, &payload) ==
+            (int)f->payload_size;
+  // The interleaved bitstreams are decoded all at once, so the whole frame
+  // needs to fit in out
+  if (ok && (f->flags & FRAME_STREAMS)) {
+    uint8_t *all = f->symbols <= out_size ? out : (uint8_t *)malloc(f->symbols);
+    ok = all && decode_streams(d, f, payload, all);
+    if (ok) {
+      write_bytes(io, outfile, all, f->symbols);
+    }
+    if (all != out) {
+      free(all);
+    }
+  } else {
+    ok = ok && start_bitstream(d, f, payload);
+    // Decode a block of symbols at a time, and write each block to outfile
+    uint32_t decoded_symbols = 0;
+    while (ok && decoded_symbols < f->symbols) {
+      uint32_t n = f->symbols - decoded_symbols;
+      if (n > out_size) {
+        n = out_size;
+      }
+      uint32_t r = decoder_decode(d, NULL, -1, out, n);
+      write_bytes(io, outfile, out, r);
+      decoded_symbols += r;
+      ok = r == n;
+    }
+  }
+  free(buf);
+  return ok;
+}
+
+// Decodes the payload of the frame f with the decoder d to out, which has
+// room for f->symbols bytes. The bitstream is read with its own bit reader,
+// so the decoder is only read and several threads can share it. Returns true
+// to indicate success, false otherwise.
+static bool decode_payload(Decoder *d, Frame *f, const uint8_t *payload,
+                           uint8_t *out) {
+  if (f->flags & FRAME_STREAMS) {
+    return decode_streams(d, f, payload, out);
+  }
+  uint32_t interval;
+  uint32_t count;
+  uint64_t skip = read_checkpoints(f, payload, &interval, &count);
+  return skip <= f->payload_size &&
+         decoder_decode_block(d, &payload[skip], f->payload_size - skip, out,
+                              f->symbols);
+}
+
+// Decodes the frame with the Frame header f, whose tree dump and payload are
+// in span, to out, which has room for f->symbols bytes. Last holds the decoder
+// of the last frame with a code (see next_decoder), and starts as NULL.
+// Nothing is read from a file, so frames in memory can be decoded on any
+// thread. Returns true to indicate success, false otherwise.
+bool frame_decode_span(Frame *f, const uint8_t *span, Decoder **last,
+                       uint8_t *out) {
+  Decoder *d = next_decoder(f, span, last);
+  return d && decode_payload(d, f, &span[f->tree_size], out);
+}
+
+// Defines what members/fields the SharedDecoders structure has.
+// Index holds the entries of the frames (see frame_index), decoders holds the
+// decoder of each frame that owns a code while it is in use (NULL otherwise),
+// and users holds the number of frames of each owner that weren't decoded
+// yet. Owner k is guarded by locks[k % DECODER_LOCKS], so threads that need
+// different codes rarely wait for each other.
+struct SharedDecoders {
+  FrameEntry *index;
+  uint32_t entries;
+  Decoder **decoders;
+  uint32_t *users;
+  pthread_mutex_t locks[DECODER_LOCKS];
+};
+
+// The constructor for a SharedDecoders, for the entries frames of the index.
+// Returns a pointer to the SharedDecoders if the memory was allocated
+// succesfully. Else, return NULL.
+SharedDecoders *shared_decoders_create(FrameEntry *index, uint32_t entries) {
+  SharedDecoders *s = (SharedDecoders *)malloc(sizeof(SharedDecoders));
+  if (!s) {
+    return NULL;
+  }
+  s->index = index;
+  s->entries = entries;
+  s->decoders = (Decoder **)calloc(entries + 1, sizeof(Decoder *));
+  s->users = (uint32_t *)calloc(entries + 1, sizeof(uint32_t));
+  if (!s->decoders || !s->users) {
+    free(s->decoders);
+    free(s->users);
+    free(s);
+    return NULL;
+  }
+  for (uint32_t i = 0; i < entries; i += 1) {
+    s->users[index[i].owner] += 1;
+  }
+  for (uint32_t l = 0; l < DECODER_LOCKS; l += 1) {
+    pthread_mutex_init(&s->locks[l], NULL);
+  }
+  return s;
+}
+
+// The destructor for a SharedDecoders. Deletes the decoders that are left,
+// frees the SharedDecoders and set the pointer to NULL.
+void shared_decoders_delete(SharedDecoders **s) {
+  if (*s) {
+    for (uint32_t i = 0; i < (*s)->entries; i += 1) {
+      decoder_delete(&(*s)->decoders[i]);
+    }
+    for (uint32_t l = 0; l < DECODER_LOCKS; l += 1) {
+      pthread_mutex_destroy(&(*s)->locks[l]);
+    }
+    free((*s)->decoders);
+    free((*s)->users);
+    free(*s);
+    *s = NULL;
+  }
+}
+
+// Gets the decoder of the code that frame i uses, and builds it from the
+// infile if no other frame built it yet. The decoder must only be read (see
+// frame_decode_at), and given back with shared_decoders_put once the frame is
+// decoded. Returns NULL if the code is invalid or the memory couldn't be
+// allocated.
+Decoder *shared_decoders_get(SharedDecoders *s, IO *io, int infile,
+                             uint32_t i) {
+  uint32_t owner = s->index[i].owner;
+  pthread_mutex_t *lock = &s->locks[owner % DECODER_LOCKS];
+  pthread_mutex_lock(lock);
+  if (!s->decoders[owner]) {
+    s->decoders[owner] = frame_decoder_at(io, infile, s->index, owner);
+  }
+  Decoder *d = s->decoders[owner];
+  pthread_mutex_unlock(lock);
+  return d;
+}
+
+// Gives back the decoder of frame i, and deletes it once every frame that
+// uses it is done, so only the codes in use take memory.
+void shared_decoders_put(SharedDecoders *s, uint32_t i) {
+  uint32_t owner = s->index[i].owner;
+  pthread_mutex_t *lock = &s->locks[owner % DECODER_LOCKS];
+  pthread_mutex_lock(lock);
+  s->users[owner] -= 1;
+  if (s->users[owner] == 0) {
+    decoder_delete(&s->decoders[owner]);
+  }
+  pthread_mutex_unlock(lock);
+}
+
+// Decodes the whole frame i of the index of the infile (see frame_index) with
+// the decoder d of its code (see shared_decoders_get), and sets f to its Frame
+// header. The infile is read with read_span_at and the decoder is only read,
+// so several threads can decode frames of the same infile at the same time.
+// Returns the decoded bytes, which the caller must free, or NULL if d is NULL,
+// the frame is invalid or the memory couldn't be allocated.
+uint8_t *frame_decode_at(IO *io, int infile, FrameEntry *index, uint32_t i,
+                         Decoder *d, Frame *f) {
+  uint64_t offset = index[i].offset;
+  uint8_t *span;
+  if (!d || read_span_at(io, infile, (uint8_t *)f, sizeof(Frame), offset,
+                         &span) != sizeof(Frame)) {
+    return NULL;
+  }
+  memmove(f, span, sizeof(Frame));
+  offset += sizeof(Frame);
+  // Gets the frame's tree and bitstream in one read
+  uint64_t size = (uint64_t)f->tree_size + f->payload_size;
+  uint8_t *buf = (uint8_t *)malloc(size);
+  uint8_t *out = (uint8_t *)malloc(f->symbols);
+  if (!buf || !out ||
+      read_span_at(io, infile, buf, size, offset, &span) != (int)size ||
+      !decode_payload(d, f, &span[f->tree_size], out)) {
+    free(out);
+    out = NULL;
+  }
+  free(buf);
+  return out;
+}
+
+// Sets the owner of each of the entries frames of the index: the frame whose
+// code it uses. That is the frame itself, unless it has FRAME_REUSE, and then
+// it is the owner of the frame before it. A first frame with FRAME_REUSE owns
+// itself, and has no code to decode with. Reads each Frame header once.
+// Returns true to indicate success, false if a header can't be read.
+static bool find_owners(IO *io, int infile, FrameEntry *index,
+                        uint32_t entries) {
+  for (uint32_t i = 0; i < entries; i += 1) {
+    Frame f;
+    uint8_t *span;
+    if (read_span_at(io, infile, (uint8_t *)&f, sizeof(Frame),
+                     index[i].offset, &span) != sizeof(Frame)) {
+      return false;
+    }
+    memmove(&f, span, sizeof(Frame));
+    index[i].owner = (f.flags & FRAME_REUSE) && i > 0 ? index[i - 1].owner : i;
+  }
+  return true;
+}
+
+// Finds the frames of a framed infile of file_size bytes. Uses the seek index
+// at the end of the infile if there is one, and otherwise goes from one Frame
+// header to the next. Sets entries to the number of frames and symbols to the
+// number of decoded bytes. Returns the frames' entries, which the caller must
+// free, or NULL if the infile is invalid or can't be read at an offset.
+FrameEntry *frame_index(IO *io, int infile, uint64_t file_size,
+                        uint32_t *entries, uint64_t *symbols) {
+  FrameEntry *index = NULL;
+  uint8_t *span;
+  // The seek index ends with a Trailer
+  Trailer t;
+  if (file_size >= sizeof(Header) + sizeof(Trailer) &&
+      read_span_at(io, infile, (uint8_t *)&t, sizeof(Trailer),
+                   file_size - sizeof(Trailer), &span) == sizeof(Trailer)) {
+    memmove(&t, span, sizeof(Trailer));
+    uint64_t size = (uint64_t)t.entries * sizeof(IndexEntry);
+    if (t.magic == MAGIC_INDEX &&
+        size <= file_size - sizeof(Header) - sizeof(Trailer)) {
+      IndexEntry *stored = (IndexEntry *)malloc(size + sizeof(IndexEntry));
+      index = (FrameEntry *)malloc(((uint64_t)t.entries + 1) *
+                                   sizeof(FrameEntry));
+      bool ok = stored && index &&
+                read_span_at(io, infile, (uint8_t *)stored, size,
+                             file_size - sizeof(Trailer) - size,
+                             &span) == (int)size;
+      if (ok) {
+        memmove(stored, span, size);
+        for (uint32_t i = 0; i < t.entries; i += 1) {
+          index[i].offset = stored[i].offset;
+          index[i].symbol = stored[i].symbol;
+        }
+        ok = find_owners(io, infile, index, t.entries);
+      }
+      free(stored);
+      if (ok) {
+        *entries = t.entries;
+        *symbols = t.symbols;
+        return index;
+      }
+      free(index);
+      index = NULL;
+    }
+  }
+  // No seek index: go from one Frame header to the next
+  uint32_t capacity = 64;
+  index = (FrameEntry *)malloc(capacity * sizeof(FrameEntry));
+  if (!index) {
+    return NULL;
+  }
+  *entries = 0;
+  *symbols = 0;
+  uint64_t offset = sizeof(Header);
+  Frame f;
+  while (read_span_at(io, infile, (uint8_t *)&f, sizeof(Frame), offset,
+                      &span) == sizeof(Frame)) {
+    memmove(&f, span, sizeof(Frame));
+    // An empty frame marks the end of the frames
+    if (f.symbols == 0) {
+      return index;
+    }
+    if (*entries == capacity) {
+      capacity = 2 * capacity;
+      FrameEntry *bigger =
+          (FrameEntry *)realloc(index, capacity * sizeof(FrameEntry));
+      if (!bigger) {
+        break;
+      }
+      index = bigger;
+    }
+    uint32_t i = *entries;
+    index[i].offset = offset;
+    index[i].symbol = *symbols;
+    index[i].owner = (f.flags & FRAME_REUSE) && i > 0 ? index[i - 1].owner : i;
+    *entries += 1;
+    *symbols += f.symbols;
+    offset += sizeof(Frame) + f.tree_size + f.payload_size;
+  }
+  free(index);
+  return NULL;
+}
+
+// Decodes the length decoded bytes that start at the given offset of the
+// output, and writes them to out. Index holds the entries of the infile's
+// frames and symbols is the number of decoded bytes (see frame_index). Only
+// the frames that hold the range are read. Inside a frame, decoding starts at
+// the last checkpoint before the offset, so a small range costs at most one
+// checkpoint interval of decoding. Frames with interleaved bitstreams are
+// decoded whole. Returns the number of bytes written to out,
+// which is less than length only if the range goes past the end of the output
+// or the infile is invalid.
+uint64_t frame_decode_range(IO *io, int infile, FrameEntry *index,
+                            uint32_t entries, uint64_t symbols,
+                            uint64_t offset, uint64_t length, uint8_t *out) {
+  if (offset >= symbols) {
+    return 0;
+  }
+  if (length > symbols - offset) {
+    length = symbols - offset;
+  }
+  // Binary search for the last frame that starts at or before the offset
+  uint32_t low = 0;
+  uint32_t high = entries;
+  while (high - low > 1) {
+    uint32_t mid = low + (high - low) / 2;
+    if (index[mid].symbol <= offset) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  // The decoder of the code of the frame owner, kept for the frames that
+  // follow it and reuse its code
+  Decoder *d = NULL;
+  uint32_t owner = entries;
+  uint64_t done = 0;
+  for (uint32_t i = low; i < entries && done < length; i += 1) {
+    // Gets the frame's header, tree and payload
+    Frame f;
+    uint8_t *span;
+    if (read_span_at(io, infile, (uint8_t *)&f, sizeof(Frame),
+                     index[i].offset, &span) != sizeof(Frame)) {
+      break;
+    }
+    memmove(&f, span, sizeof(Frame));
+    uint64_t size = (uint64_t)f.tree_size + f.payload_size;
+    uint8_t *buf = (uint8_t *)malloc(size);
+    if (!buf || read_span_at(io, infile, buf, size,
+                             index[i].offset + sizeof(Frame),
+                             &span) != (int)size) {
+      free(buf);
+      break;
+    }
+    if (index[i].owner != owner) {
+      decoder_delete(&d);
+      owner = index[i].owner;
+      d = owner == i ? frame_decoder(&f, span)
+                     : frame_decoder_at(io, infile, index, owner);
+    }
+    if (!d) {
+      free(buf);
+      break;
+    }
+    uint8_t *payload = &span[f.tree_size];
+    uint64_t first = offset + done - index[i].symbol;
+    uint64_t n = f.symbols - first < length - done ? f.symbols - first
+                                                   : length - done;
+    if (f.flags & FRAME_STREAMS) {
+      uint8_t *all = (uint8_t *)malloc(f.symbols);
+      bool ok = all && decode_streams(d, &f, payload, all);
+      if (ok) {
+        memcpy(&out[done], &all[first], n);
+      }
+      free(all);
+      free(buf);
+      if (!ok) {
+        break;
+      }
+      done += n;
+      continue;
+    }
+    // Find the last checkpoint at or before the first wanted symbol
+    uint32_t interval;
+    uint32_t count;
+    uint64_t skip = read_checkpoints(&f, payload, &interval, &count);
+    uint64_t position = 0;
+    uint64_t bit = 0;
+    if (skip <= f.payload_size && interval != 0 && count != 0 &&
+        first >= interval) {
+      uint64_t k = first / interval;
+      k = k < count ? k : count;
+      memcpy(&bit, &payload[8 + 8 * (k - 1)], 8);
+      position = k * interval;
+    }
+    bool ok = skip <= f.payload_size && bit / 8 <= f.payload_size - skip;
+    if (ok) {
+      decoder_reset(d, &payload[skip + bit / 8],
+                    f.payload_size - skip - bit / 8);
+      ok = decoder_skip(d, bit % 8);
+    }
+    // Decode up to the first wanted symbol and throw those symbols away,
+    // then decode the wanted symbols of this frame
+    uint8_t discard[BLOCK];
+    while (ok && position < first) {
+      uint64_t n = first - position < BLOCK ? first - position : BLOCK;
+      ok = decoder_decode(d, NULL, -1, discard, n) == n;
+      position += n;
+    }
+    ok = ok && decoder_decode(d, NULL, -1, &out[done], n) == n;
+    free(buf);
+    if (!ok) {
+      break;
+    }
+    done += n;
+  }
+  decoder_delete(&d);
+  return done;
+}
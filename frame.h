@@ -0,0 +1,61 @@
+#pragma once
+
+#include "decoder.h"
+#include "defines.h"
+#include "header.h"
+#include "io.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// An entry of the frames that frame_index finds: the offset of the frame's
+// Frame header in the infile, the offset of its first byte in the decoded
+// output, and the index of the frame whose code it uses (itself, unless it
+// has FRAME_REUSE).
+typedef struct {
+    uint64_t offset;
+    uint64_t symbol;
+    uint32_t owner;
+} FrameEntry;
+
+typedef struct SharedDecoders SharedDecoders;
+
+bool frame_code(const uint8_t *data, uint32_t n, uint32_t limit,
+                uint64_t hist[static ALPHABET],
+                uint8_t lengths[static ALPHABET]);
+
+bool frame_reuse(uint64_t hist[static ALPHABET],
+                 uint8_t lengths[static ALPHABET],
+                 uint8_t previous[static ALPHABET]);
+
+uint64_t frame_write(const uint8_t *data, uint32_t n, uint32_t interval,
+                     bool streams, uint64_t hist[static ALPHABET],
+                     uint8_t lengths[static ALPHABET], bool reuse,
+                     uint8_t **frame);
+
+uint64_t frame_encode(const uint8_t *data, uint32_t n, uint32_t interval,
+                      uint32_t limit, bool streams, uint8_t **frame);
+
+bool frame_decode(IO *io, int infile, int outfile, Frame *f, Decoder **last,
+                  uint8_t *out, uint32_t out_size);
+
+bool frame_decode_span(Frame *f, const uint8_t *span, Decoder **last,
+                       uint8_t *out);
+
+SharedDecoders *shared_decoders_create(FrameEntry *index, uint32_t entries);
+
+void shared_decoders_delete(SharedDecoders **s);
+
+Decoder *shared_decoders_get(SharedDecoders *s, IO *io, int infile,
+                             uint32_t i);
+
+void shared_decoders_put(SharedDecoders *s, uint32_t i);
+
+uint8_t *frame_decode_at(IO *io, int infile, FrameEntry *index, uint32_t i,
+                         Decoder *d, Frame *f);
+
+FrameEntry *frame_index(IO *io, int infile, uint64_t file_size,
+                        uint32_t *entries, uint64_t *symbols);
+
+uint64_t frame_decode_range(IO *io, int infile, FrameEntry *index,
+                            uint32_t entries, uint64_t symbols,
+                            uint64_t offset, uint64_t length, uint8_t *out);
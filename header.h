@@ -8,3 +8,21 @@ typedef struct {
     uint16_t tree_size;
     uint64_t file_size;
 } Header;
+
+typedef struct {
+    uint32_t symbols;
+    uint32_t payload_size;
+    uint16_t tree_size;
+    uint16_t flags;
+} Frame;
+
+typedef struct {
+    uint64_t offset;
+    uint64_t symbol;
+} IndexEntry;
+
+typedef struct {
+    uint64_t symbols;
+    uint32_t entries;
+    uint32_t magic;
+} Trailer;
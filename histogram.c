@@ -0,0 +1,141 @@
+#include "histogram.h"
+#include "defines.h"
+#include <stdint.h>
+#include <string.h>
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(HISTOGRAM_PORTABLE)
+#include <immintrin.h>
+#define HISTOGRAM_X86
+#endif
+
+// Goal: count how many times each byte appears in a buffer, as fast as the
+// buffer can be read. Incrementing one table for every byte makes each
+// increment of a repeated byte wait for the previous one to be stored, so the
+// bytes are spread over HIST_WAYS smaller tables (sub-histograms) that are
+// added up at the end. On x86, a wide compare first checks if a whole vector
+// of bytes is the same byte, and counts such runs with a single add. AVX2 or
+// SSE2 is picked once, at the first call, and other machines use the portable
+// loop. Every x86-64 CPU has SSE2, so a build with -DHISTOGRAM_PORTABLE
+// (make HISTOGRAM_PORTABLE=1) uses the portable loop everywhere, to test it.
+
+// A kernel that counts the n bytes of data in the sub-histograms.
+typedef void (*Counter)(const uint8_t *data, uint64_t n,
+                        uint32_t sub[][ALPHABET]);
+
+// Counts the bytes of one 8-byte word of data in the sub-histograms.
+static inline void count_word(const uint8_t *data, uint32_t sub[][ALPHABET]) {
+  uint64_t w;
+  memcpy(&w, data, sizeof(w));
+  sub[0][w & 0xFF] += 1;
+  sub[1][(w >> 8) & 0xFF] += 1;
+  sub[2][(w >> 16) & 0xFF] += 1;
+  sub[3][(w >> 24) & 0xFF] += 1;
+  sub[0][(w >> 32) & 0xFF] += 1;
+  sub[1][(w >> 40) & 0xFF] += 1;
+  sub[2][(w >> 48) & 0xFF] += 1;
+  sub[3][w >> 56] += 1;
+}
+
+// Counts the n bytes of data in the sub-histograms, a word at a time.
+static inline void count_portable(const uint8_t *data, uint64_t n,
+                                  uint32_t sub[][ALPHABET]) {
+  uint64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    count_word(&data[i], sub);
+  }
+  for (; i < n; i += 1) {
+    sub[0][data[i]] += 1;
+  }
+}
+
+#ifdef HISTOGRAM_X86
+// Counts the n bytes of data in the sub-histograms, 32 bytes at a time. A run
+// of 32 equal bytes is counted at once.
+__attribute__((target("avx2"))) static void
+count_avx2(const uint8_t *data, uint64_t n, uint32_t sub[][ALPHABET]) {
+  uint64_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)&data[i]);
+    __m256i same = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(data[i]));
+    if ((uint32_t)_mm256_movemask_epi8(same) == 0xFFFFFFFF) {
+      sub[0][data[i]] += 32;
+      continue;
+    }
+    count_word(&data[i], sub);
+    count_word(&data[i + 8], sub);
+    count_word(&data[i + 16], sub);
+    count_word(&data[i + 24], sub);
+  }
+  count_portable(&data[i], n - i, sub);
+}
+
+// Counts the n bytes of data in the sub-histograms, 16 bytes at a time. A run
+// of 16 equal bytes is counted at once.
+__attribute__((target("sse2"))) static void
+count_sse2(const uint8_t *data, uint64_t n, uint32_t sub[][ALPHABET]) {
+  uint64_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)&data[i]);
+    __m128i same = _mm_cmpeq_epi8(v, _mm_set1_epi8(data[i]));
+    if (_mm_movemask_epi8(same) == 0xFFFF) {
+      sub[0][data[i]] += 16;
+      continue;
+    }
+    count_word(&data[i], sub);
+    count_word(&data[i + 8], sub);
+  }
+  count_portable(&data[i], n - i, sub);
+}
+#endif
+
+// Returns the fastest kernel the CPU can run.
+static Counter pick_counter(void) {
+#ifdef HISTOGRAM_X86
+  if (__builtin_cpu_supports("avx2")) {
+    return count_avx2;
+  }
+#ifdef __i386__
+  if (!__builtin_cpu_supports("sse2")) {
+    return count_portable;
+  }
+#endif
+  return count_sse2;
+#else
+  return count_portable;
+#endif
+}
+
+// The kernel that pick_counter picked, once a call has picked it. Threads
+// that call histogram at the same time pick the same kernel.
+static Counter counter = NULL;
+
+// Adds the number of times each byte appears in the n bytes of data to hist.
+// Hist is not cleared first, so a histogram can be built from several calls.
+void histogram(const uint8_t *data, uint64_t n,
+               uint64_t hist[static ALPHABET]) {
+  // Setting up and adding the sub-histograms only pays off for longer buffers
+  if (n < HIST_SMALL) {
+    for (uint64_t i = 0; i < n; i += 1) {
+      hist[data[i]] += 1;
+    }
+    return;
+  }
+  Counter count = __atomic_load_n(&counter, __ATOMIC_RELAXED);
+  if (!count) {
+    count = pick_counter();
+    __atomic_store_n(&counter, count, __ATOMIC_RELAXED);
+  }
+  uint32_t sub[HIST_WAYS][ALPHABET];
+  while (n > 0) {
+    // The 32-bit counters can't overflow in a chunk
+    uint64_t chunk = n < HIST_CHUNK ? n : HIST_CHUNK;
+    memset(sub, 0, sizeof(sub));
+    count(data, chunk, sub);
+    for (uint32_t w = 0; w < HIST_WAYS; w += 1) {
+      for (uint32_t i = 0; i < ALPHABET; i += 1) {
+        hist[i] += sub[w][i];
+      }
+    }
+    data += chunk;
+    n -= chunk;
+  }
+}
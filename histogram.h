@@ -0,0 +1,7 @@
+#pragma once
+
+#include "defines.h"
+#include <stdint.h>
+
+void histogram(const uint8_t *data, uint64_t n,
+               uint64_t hist[static ALPHABET]);
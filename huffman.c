@@ -1,127 +1,263 @@
 #include "huffman.h"
+#include "arena.h"
 #include "code.h"
 #include "defines.h"
 #include "io.h"
 #include "node.h"
-#include "pq.h"
-#include "stack.h"
 #include <ctype.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 // Goal: an interface for the provided Huffman coding module.
 
-// Creates a static Code variable that will hold a vale through recursion calls
-// on the build_codes function
-static Code c = {0, {0}};
-
-// Creates a tree given given a histogram (using a priority queue).
-Node *build_tree(uint64_t hist[static ALPHABET]) {
-  // Step 1: creates a priority queue and populate it using the histogram
-  PriorityQueue *pq = pq_create(ALPHABET);
-  // Go through each element in the histogram, and create a node that is
-  // associated with it
-  for (uint64_t i = 0; i < ALPHABET; i += 1) {
+// Sorts the symbols of hist that have a non-zero frequency by frequency, and
+// stores them in order. Uses a radix sort on the bytes of the frequencies,
+// from the lowest byte up, and skips the bytes that are the same for every
+// symbol (such as the high bytes, which are usually all 0). Each pass is
+// stable, so symbols with the same frequency stay in order of symbol. Returns
+// the number of symbols in order.
+static uint32_t sort_symbols(uint64_t hist[static ALPHABET],
+                             uint8_t order[static ALPHABET]) {
+  uint8_t other[ALPHABET];
+  uint32_t n = 0;
+  uint64_t all = 0;
+  uint64_t any = 0;
+  for (uint32_t i = 0; i < ALPHABET; i += 1) {
     if (hist[i] > 0) {
-      Node *n = node_create(i, hist[i]);
-      enqueue(pq, n);
+      order[n] = i;
+      n += 1;
+      all = n == 1 ? hist[i] : all & hist[i];
+      any |= hist[i];
     }
   }
-  // Step 2: construct a huffman tree
-  // As long as there are more than two elements at the priority queue
-  while (pq_size(pq) > 1) {
-    // Get the left and right children and join them
-    Node *left;
-    dequeue(pq, &left);
-    Node *right;
-    dequeue(pq, &right);
-    Node *parent = node_join(left, right);
-    // Add the joined node to the priority queue.
-    // Add the left and right children & the joined node to the tree
-    enqueue(pq, parent);
-  }
-  // Return the root of the tree (last element in the priority queue)
-  Node *root;
-  dequeue(pq, &root);
-  pq_delete(&pq);
-  return root;
+  uint8_t *from = order;
+  uint8_t *to = other;
+  for (uint32_t shift = 0; shift < 64; shift += 8) {
+    // Every frequency has the same byte here, so the pass wouldn't move them
+    if (((all >> shift) & 0xFF) == ((any >> shift) & 0xFF)) {
+      continue;
+    }
+    uint32_t start[ALPHABET + 1];
+    memset(start, 0, sizeof(start));
+    for (uint32_t i = 0; i < n; i += 1) {
+      start[((hist[from[i]] >> shift) & 0xFF) + 1] += 1;
+    }
+    for (uint32_t b = 1; b < ALPHABET; b += 1) {
+      start[b + 1] += start[b];
+    }
+    for (uint32_t i = 0; i < n; i += 1) {
+      uint32_t b = (hist[from[i]] >> shift) & 0xFF;
+      to[start[b]] = from[i];
+      start[b] += 1;
+    }
+    uint8_t *t = from;
+    from = to;
+    to = t;
+  }
+  if (from != order) {
+    memcpy(order, from, n);
+  }
+  return n;
 }
 
-// Creates a code table based on the Huffman tree we built.
-// Takes as arguments the root of the tree and an empty code table to be filled
-// out.
-void build_codes(Node *root, Code table[static ALPHABET]) {
+// Builds the Huffman tree of hist in flat arrays instead of Nodes. The leaves
+// are nodes 0 to n-1, sorted by frequency (their symbols are in order), and
+// the interior nodes are n to 2n-2, with the root last. Left and right hold
+// the children of interior node n+i at index i. Since the leaves are sorted
+// and every new interior node weighs at least as much as the one before it,
+// the two lightest nodes are always at the front of either the leaves or the
+// interior nodes. That makes the tree take O(n) steps instead of a priority
+// queue. Returns n, the number of leaves.
+static uint32_t flat_tree(uint64_t hist[static ALPHABET],
+                          uint8_t order[static ALPHABET],
+                          uint16_t left[static ALPHABET],
+                          uint16_t right[static ALPHABET]) {
+  uint32_t n = sort_symbols(hist, order);
+  uint64_t weight[2 * ALPHABET];
+  for (uint32_t i = 0; i < n; i += 1) {
+    weight[i] = hist[order[i]];
+  }
+  // The fronts of the two queues: the next leaf and the next interior node
+  uint32_t leaf = 0;
+  uint32_t interior = n;
+  for (uint32_t next = n; next + 1 < 2 * n; next += 1) {
+    uint16_t children[2];
+    for (uint32_t c = 0; c < 2; c += 1) {
+      // A leaf goes first on a tie
+      if (leaf < n && (interior == next || weight[leaf] <= weight[interior])) {
+        children[c] = leaf;
+        leaf += 1;
+      } else {
+        children[c] = interior;
+        interior += 1;
+      }
+    }
+    left[next - n] = children[0];
+    right[next - n] = children[1];
+    weight[next] = weight[children[0]] + weight[children[1]];
+  }
+  return n;
+}
+
+// Sets lengths to the length of the Huffman code of each symbol of hist, and
+// 0 for the symbols that are not in hist, without creating a tree of Nodes.
+void build_lengths(uint64_t hist[static ALPHABET],
+                   uint8_t lengths[static ALPHABET]) {
+  uint8_t order[ALPHABET];
+  uint16_t left[ALPHABET];
+  uint16_t right[ALPHABET];
+  uint32_t n = flat_tree(hist, order, left, right);
+  memset(lengths, 0, ALPHABET);
+  if (n < 2) {
+    if (n == 1) {
+      lengths[order[0]] = 1;
+    }
+    return;
+  }
+  // The children of a node always come before it, so going from the root
+  // down, every node's depth is known before its children's
+  uint8_t depth[2 * ALPHABET];
+  depth[2 * n - 2] = 0;
+  for (uint32_t i = 2 * n - 2; i >= n; i -= 1) {
+    depth[left[i - n]] = depth[i] + 1;
+    depth[right[i - n]] = depth[i] + 1;
+  }
+  for (uint32_t i = 0; i < n; i += 1) {
+    lengths[order[i]] = depth[i];
+  }
+}
+
+// Creates a tree given given a histogram. The tree is built in flat arrays by
+// flat_tree, and then turned into Nodes of the arena a, which must be empty.
+// Returns the root, or NULL if hist is empty.
+Node *build_tree(Arena *a, uint64_t hist[static ALPHABET]) {
+  uint8_t order[ALPHABET];
+  uint16_t left[ALPHABET];
+  uint16_t right[ALPHABET];
+  uint32_t n = flat_tree(hist, order, left, right);
+  if (n == 0) {
+    return NULL;
+  }
+  Node *nodes[2 * ALPHABET];
+  for (uint32_t i = 0; i < n; i += 1) {
+    nodes[i] = arena_node(a, order[i], hist[order[i]]);
+  }
+  // The parent has the sum of the frequencies of its children
+  for (uint32_t i = n; i < 2 * n - 1; i += 1) {
+    nodes[i] = arena_join(a, nodes[left[i - n]], nodes[right[i - n]]);
+  }
+  // Return the root of the tree (the last node)
+  return nodes[2 * n - 2];
+}
+
+// Fills out the code table for the leaves below the node root. The Code c
+// holds the path from the tree's root to this node, and it is changed and put
+// back while going through the tree.
+static void build_codes_from(Node *root, Code table[static ALPHABET],
+                             Code *c) {
   // If the node exists
   if (root != NULL) {
     // If we are at a leaf, set the current location of the table to the code
     if ((!root->left) && (!root->right)) {
-      table[root->symbol] = c;
+      table[root->symbol] = *c;
     } else {
       // If we are going to the left, push the number 0
-      code_push_bit(&c, 0);
-      build_codes(root->left, table);
+      code_push_bit(c, 0);
+      build_codes_from(root->left, table, c);
       // Remove the node we already found a code for
       uint8_t b = 0;
-      code_pop_bit(&c, &b);
+      code_pop_bit(c, &b);
       // If we are going t the right, push the number 1
-      code_push_bit(&c, 1);
-      build_codes(root->right, table);
-      code_pop_bit(&c, &b);
+      code_push_bit(c, 1);
+      build_codes_from(root->right, table, c);
+      code_pop_bit(c, &b);
     }
   }
 }
 
-// Creates a string representation of the tree and write it to outfile.
-void dump_tree(int outfile, Node *root) {
+// Creates a code table based on the Huffman tree we built.
+// Takes as arguments the root of the tree and an empty code table to be filled
+// out. The path to the current node is kept in a local Code instead of a
+// static one, so several threads can build code tables at the same time.
+void build_codes(Node *root, Code table[static ALPHABET]) {
+  Code c = code_init();
+  build_codes_from(root, table, &c);
+}
+
+// Creates a string representation of the tree in the buf argument, which must
+// hold at least MAX_TREE_SIZE bytes. Returns the number of bytes in the dump.
+uint16_t dump_tree_buffer(Node *root, uint8_t *buf) {
+  uint16_t size = 0;
   // If the node exists
   if (root) {
     // Use post order traversal to go through the tree
-    dump_tree(outfile, root->left);
-    dump_tree(outfile, root->right);
+    size += dump_tree_buffer(root->left, &buf[size]);
+    size += dump_tree_buffer(root->right, &buf[size]);
     // If we are at the leaf, push the character L and the node's symbol
     if (!root->left && !root->right) {
-      uint8_t buf = 'L';
-      write_bytes(outfile, &buf, 1);
-      write_bytes(outfile, &root->symbol, 1);
+      buf[size] = 'L';
+      buf[size + 1] = root->symbol;
+      size += 2;
     }
     // Else, we are in an interior node, push the character I
     else {
-      uint8_t buf = 'I';
-      write_bytes(outfile, &buf, 1);
+      buf[size] = 'I';
+      size += 1;
     }
   }
+  return size;
 }
 
-// Recobstructs the Huffman tree based on the given tree dump
-Node *rebuild_tree(uint16_t nbytes, uint8_t tree[static nbytes]) {
-  // Create a stack
-  Stack *s = stack_create(nbytes);
+// Creates a string representation of the tree and write it to outfile with the
+// io.
+void dump_tree(IO *io, int outfile, Node *root) {
+  // Dump the tree to memory first, so it is written with a single call
+  uint8_t buf[MAX_TREE_SIZE];
+  uint16_t size = dump_tree_buffer(root, buf);
+  write_bytes(io, outfile, buf, size);
+}
+
+// Recobstructs the Huffman tree based on the given tree dump, as a flat tree
+// for decoding. The dump is in post-order, so the children of each interior
+// node come before it in t. Returns false if the dump is not a valid tree.
+bool rebuild_tree(uint16_t nbytes, const uint8_t tree[static nbytes],
+                  FlatTree *t) {
+  // A stack of the subtrees that are not joined yet. A valid tree has at most
+  // one leaf per symbol.
+  uint16_t stack[ALPHABET];
+  uint32_t top = 0;
+  t->size = 0;
   for (uint32_t i = 0; i < nbytes; i += 1) {
     // Leaf node: push the next element of the tree to the stack
-    if (tree[i] == 'L') {
-      Node *n = node_create(tree[i + 1], 0); 
-      stack_push(s, n);
+    if (tree[i] == 'L' && i + 1 < nbytes && top < ALPHABET) {
+      stack[top] = FLAT_LEAF | tree[i + 1];
+      top += 1;
       i += 1;
     }
-    // Interior node: joins the top two nodes of the stack
-    else if (tree[i] == 'I') {
-      Node *right;
-      stack_pop(s, &right);
-      Node *left;
-      stack_pop(s, &left);
-      Node *parent = node_join(left, right);
-      stack_push(s, parent);
+    // Interior node: joins the top two subtrees of the stack
+    else if (tree[i] == 'I' && top >= 2 && t->size < ALPHABET - 1) {
+      t->child[t->size][0] = stack[top - 2];
+      t->child[t->size][1] = stack[top - 1];
+      stack[top - 2] = t->size;
+      top -= 1;
+      t->size += 1;
+    } else {
+      return false;
     }
   }
-  // Returns the root of the tree, it is the last node in the stack
-  Node *root;
-  stack_pop(s, &root);
-  stack_delete(&s);
-  return root;
+  // The root of the tree is the only subtree left in the stack
+  if (top != 1) {
+    return false;
+  }
+  t->root = stack[0];
+  return true;
 }
 
-// The destructor for the tree. Use post-order traversal to delete all the nodes in the tree.
+// The destructor for a tree made with node_create (not with an Arena). Use
+// post-order traversal to delete all the nodes in the tree.
 // Start from left child, move to right child, and then delete the node.
 void delete_tree(Node **root) {
   if ((*root)->left) {
@@ -1,16 +1,25 @@
 #pragma once
 
+#include "arena.h"
 #include "node.h"
 #include "code.h"
 #include "defines.h"
+#include "io.h"
+#include <stdbool.h>
 #include <stdint.h>
 
-Node *build_tree(uint64_t hist[static ALPHABET]);
+Node *build_tree(Arena *a, uint64_t hist[static ALPHABET]);
+
+void build_lengths(uint64_t hist[static ALPHABET],
+                   uint8_t lengths[static ALPHABET]);
 
 void build_codes(Node *root, Code table[static ALPHABET]);
 
-void dump_tree(int outfile, Node *root);
+uint16_t dump_tree_buffer(Node *root, uint8_t *buf);
+
+void dump_tree(IO *io, int outfile, Node *root);
 
-Node *rebuild_tree(uint16_t nbytes, uint8_t tree[static nbytes]);
+bool rebuild_tree(uint16_t nbytes, const uint8_t tree[static nbytes],
+                  FlatTree *t);
 
 void delete_tree(Node **root);
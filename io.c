@@ -1,131 +1,439 @@
 #include "io.h"
 #include "code.h"
 #include "defines.h"
+#include "memstats.h"
+#include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 // Goal: handle file actions, such as read and write. Will be used by the
-// encoder and decoder to perform actions on files.
+// encoder and decoder to perform actions on files. All the state (buffers,
+// bit buffer, mapped file and byte counts) lives in an IO, which is passed to
+// every function.
 
-// Global variables that will hold the number of bytes read and written
-uint64_t bytes_read;
-uint64_t bytes_written;
+// Defines what members/fields an IO has. There is no global state, so each
+// thread (or each library call) can use its own IO.
+// Buffer_size is the size of both buffers.
+// Buffer holds the last block read by read_block, current_block points at the
+// last block (the buffer, or a part of the mapped file), block_size is the
+// number of bytes in it, index_byte is the next byte that read_bit returns
+// bits of, and current_bit is the next bit of that byte.
+// Buffer_code collects the bytes written by write_bits until it is full, and
+// index_code is the number of bytes in it. Bit_buffer holds the bit_count bits
+// that don't fill a whole word yet.
+// When the infile is mapped into memory, map_fd is its file descriptor,
+// map_base and map_size are the mapped bytes, and map_pos is the offset of the
+// next byte to read (it takes the place of the file offset). Bytes that were
+// already in memory (see io_attach) are read the same way, with map_fd set to
+// ATTACHED_FD.
+// Bytes_read and bytes_written count the bytes read and written with the IO,
+// and syscalls counts the read and write system calls that moved them.
+// Failed is set once a read or write system call fails, so a read that stopped
+// early on an error can be told from the end of the file.
+struct IO {
+  uint32_t buffer_size;
+  uint8_t *buffer;
+  uint8_t *current_block;
+  int block_size;
+  int index_byte;
+  int current_bit;
+  uint8_t *buffer_code;
+  uint32_t index_code;
+  uint64_t bit_buffer;
+  uint32_t bit_count;
+  int map_fd;
+  uint8_t *map_base;
+  uint64_t map_size;
+  uint64_t map_pos;
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  uint64_t syscalls;
+  bool failed;
+};
 
-// Static vars
-static uint8_t buffer[BLOCK];
-static int index_byte = BLOCK;
-static uint8_t buffer_code[BLOCK];
-static uint32_t index_code;
-static int current_bit = 0;
+// The constructor for an IO. The size of the input and output buffers is
+// rounded up to a multiple of 8 bytes. Returns a pointer to the IO if the
+// memory was allocated succesfully. Else, return NULL.
+IO *io_create(uint32_t buffer_size) {
+  buffer_size = (buffer_size + 7) / 8 * 8;
+  if (buffer_size == 0) {
+    return NULL;
+  }
+  IO *io = (IO *)calloc(1, sizeof(IO));
+  if (io) {
+    io->buffer = (uint8_t *)malloc(buffer_size);
+    io->buffer_code = (uint8_t *)malloc(buffer_size);
+    if (!io->buffer || !io->buffer_code) {
+      free(io->buffer);
+      free(io->buffer_code);
+      free(io);
+      return NULL;
+    }
+    io->buffer_size = buffer_size;
+    io->current_block = io->buffer;
+    io->map_fd = -1;
+  }
+  return io;
+}
+
+// The destructor for an IO. Frees the buffers, unmaps the mapped infile, frees
+// the IO and set the pointer to NULL.
+void io_delete(IO **io) {
+  if (*io) {
+    if ((*io)->map_base && (*io)->map_fd != ATTACHED_FD) {
+      munmap((*io)->map_base, (*io)->map_size);
+    }
+    free((*io)->buffer);
+    free((*io)->buffer_code);
+    free(*io);
+    *io = NULL;
+  }
+}
+
+// Returns the size of the input and output buffers.
+uint32_t io_buffer_size(IO *io) { return io->buffer_size; }
+
+// Returns the number of bytes read with the IO.
+uint64_t io_bytes_read(IO *io) { return io->bytes_read; }
+
+// Returns the number of bytes written with the IO.
+uint64_t io_bytes_written(IO *io) { return io->bytes_written; }
+
+// Returns the number of read and write system calls made with the IO.
+uint64_t io_syscalls(IO *io) {
+  return __atomic_load_n(&io->syscalls, __ATOMIC_RELAXED);
+}
+
+// Returns true if a read or write with the IO failed.
+bool io_failed(IO *io) {
+  return __atomic_load_n(&io->failed, __ATOMIC_RELAXED);
+}
+
+// Returns the number of mapped bytes that can be read at once, at most max.
+static uint64_t map_take(IO *io, uint64_t max) {
+  uint64_t n = io->map_size - io->map_pos;
+  return n < max ? n : max;
+}
 
-// Read all the specified bytes from a file to the buffer argument buf
-int read_bytes(int infile, uint8_t *buf, int nbytes) {
+// Read all the specified bytes from a file to the buffer argument buf. Stops
+// early only at the end of the file or on an error.
+int read_bytes(IO *io, int infile, uint8_t *buf, int nbytes) {
+  // A mapped infile is read by copying the bytes from memory
+  if (infile == io->map_fd) {
+    int n = map_take(io, nbytes);
+    memcpy(buf, &io->map_base[io->map_pos], n);
+    io->map_pos += n;
+    io->bytes_read += n;
+    return n;
+  }
   // Need to read only the number of bytes specified, so stops after reaching
   // this threshold
   int bytes_read_once = 0;
   while (bytes_read_once < nbytes) {
-    // Use the library's read function to read one byte at a time
-    int r = read(infile, &buf[bytes_read_once], 1);
+    // Ask for all the bytes that are left. Pipes and terminals may return
+    // fewer bytes than asked for, so keep reading until we have them all.
+    ssize_t r =
+        read(infile, &buf[bytes_read_once], nbytes - bytes_read_once);
+    io->syscalls += 1;
+    // Try again if a signal interrupted the read
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
     // The function returns 0 once it reaches the end of the file
     if (r <= 0) {
+      if (r < 0) {
+        io->failed = true;
+      }
       break;
     }
     // Increase the number of bytes read
-    bytes_read_once += 1;
+    bytes_read_once += r;
   }
   // Add to the total number of bytes_read, the number of bytes read in this
   // function call
-  bytes_read += bytes_read_once;
+  io->bytes_read += bytes_read_once;
   return bytes_read_once;
 }
 
 // Write all the specified bytes from the buffer argument buf to the outfile
-// file
-int write_bytes(int outfile, uint8_t *buf, int nbytes) {
+// file. Stops early only on an error.
+int write_bytes(IO *io, int outfile, uint8_t *buf, int nbytes) {
   int bytes_written_once = 0;
   while (bytes_written_once < nbytes) {
-    // Use the library's write function to write one byte at a time
-    int w = write(outfile, &buf[bytes_written_once], 1);
-    // The function returns 0 once it reaches the end of the file
+    // Write all the bytes that are left, and keep writing after a short write
+    ssize_t w =
+        write(outfile, &buf[bytes_written_once], nbytes - bytes_written_once);
+    io->syscalls += 1;
+    // Try again if a signal interrupted the write
+    if (w < 0 && errno == EINTR) {
+      continue;
+    }
     if (w <= 0) {
+      io->failed = true;
       break;
     }
     // Increase the number of bytes written
-    bytes_written_once += 1;
+    bytes_written_once += w;
   }
   // Add to the total number of bytes_written, the number of bytes written in
   // this function call
-  bytes_written += bytes_written_once;
+  io->bytes_written += bytes_written_once;
+  return bytes_written_once;
+}
+
+// Maps the infile into memory, so that read_bytes and read_block read it
+// without a system call, and read_block without copying it. Reading continues
+// from the current offset of the infile. Only regular files can be mapped, so
+// pipes and terminals keep being read with read(). Returns true if the infile
+// was mapped, false otherwise.
+bool io_map(IO *io, int infile) {
+  struct stat st;
+  if (io->map_base || fstat(infile, &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_size == 0) {
+    return false;
+  }
+  off_t pos = lseek(infile, 0, SEEK_CUR);
+  if (pos < 0 || pos > st.st_size) {
+    return false;
+  }
+  void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, infile, 0);
+  if (m == MAP_FAILED) {
+    return false;
+  }
+  // Both passes of the encoder and the decoder read the file from start to
+  // end, so the kernel can read ahead and drop the pages behind us.
+  madvise(m, st.st_size, MADV_SEQUENTIAL);
+  io->map_fd = infile;
+  io->map_base = (uint8_t *)m;
+  io->map_size = st.st_size;
+  io->map_pos = pos;
+  return true;
+}
+
+// Lets the IO read the size bytes of src as if they were a mapped infile, so
+// code written for files (such as the seek index and range decoding) can read
+// a buffer in memory. The bytes are never written, and must stay valid while
+// the IO uses them. Returns the descriptor to read them with, or -1 if the IO
+// already maps a file.
+int io_attach(IO *io, const uint8_t *src, uint64_t size) {
+  if (io->map_base) {
+    return -1;
+  }
+  io->map_fd = ATTACHED_FD;
+  io->map_base = (uint8_t *)src;
+  io->map_size = size;
+  io->map_pos = 0;
+  return ATTACHED_FD;
+}
+
+// Returns true if the infile is mapped into memory with io_map.
+bool io_mapped(IO *io, int infile) { return infile == io->map_fd; }
+
+// Goes back to the start of the infile, so it can be read again.
+void io_rewind(IO *io, int infile) {
+  if (infile == io->map_fd) {
+    io->map_pos = 0;
+  } else {
+    lseek(infile, 0, SEEK_SET);
+  }
+  io->block_size = 0;
+  io->index_byte = 0;
+  io->current_bit = 0;
+}
+
+// Read the next block of up to buffer_size bytes from the infile to the input
+// buffer of the IO, and set the block argument to point at it. A mapped infile
+// is not copied: the block points straight at the mapped bytes, and it can be
+// much larger than buffer_size. The bytes of the block must not be changed.
+// Returns the number of bytes in the block, 0 at the end of the file.
+int read_block(IO *io, int infile, uint8_t **block) {
+  if (infile == io->map_fd) {
+    io->current_block = &io->map_base[io->map_pos];
+    io->block_size = map_take(io, MAP_CHUNK);
+    io->map_pos += io->block_size;
+    io->bytes_read += io->block_size;
+  } else {
+    io->current_block = io->buffer;
+    io->block_size = read_bytes(io, infile, io->buffer, io->buffer_size);
+  }
+  io->index_byte = 0;
+  io->current_bit = 0;
+  *block = io->current_block;
+  return io->block_size;
+}
+
+// Read up to nbytes bytes from the infile, and set the span argument to point
+// at them. A mapped infile is not copied: span points straight at the mapped
+// bytes. Otherwise the bytes are read into the buf argument, and span points
+// at buf. Returns the number of bytes read.
+int read_span(IO *io, int infile, uint8_t *buf, int nbytes, uint8_t **span) {
+  if (infile == io->map_fd) {
+    int n = map_take(io, nbytes);
+    *span = &io->map_base[io->map_pos];
+    io->map_pos += n;
+    io->bytes_read += n;
+    return n;
+  }
+  *span = buf;
+  return read_bytes(io, infile, buf, nbytes);
+}
+
+// Read up to nbytes bytes at the given offset of the infile, and set the span
+// argument to point at them, like read_span. The file offset is not used or
+// changed, so several threads can read different parts of the infile at the
+// same time. Returns the number of bytes read.
+int read_span_at(IO *io, int infile, uint8_t *buf, int nbytes,
+                 uint64_t offset, uint8_t **span) {
+  int bytes_read_once = 0;
+  if (infile == io->map_fd) {
+    if (offset < io->map_size) {
+      bytes_read_once = io->map_size - offset < (uint64_t)nbytes
+                            ? (int)(io->map_size - offset)
+                            : nbytes;
+    }
+    *span = &io->map_base[offset < io->map_size ? offset : io->map_size];
+  } else {
+    *span = buf;
+    while (bytes_read_once < nbytes) {
+      ssize_t r = pread(infile, &buf[bytes_read_once],
+                        nbytes - bytes_read_once, offset + bytes_read_once);
+      __atomic_fetch_add(&io->syscalls, 1, __ATOMIC_RELAXED);
+      // Try again if a signal interrupted the read
+      if (r < 0 && errno == EINTR) {
+        continue;
+      }
+      if (r <= 0) {
+        if (r < 0) {
+          __atomic_store_n(&io->failed, true, __ATOMIC_RELAXED);
+        }
+        break;
+      }
+      bytes_read_once += r;
+    }
+  }
+  // Other threads may be counting their bytes at the same time
+  __atomic_fetch_add(&io->bytes_read, bytes_read_once, __ATOMIC_RELAXED);
+  return bytes_read_once;
+}
+
+// Write all the specified bytes from the buffer argument buf at the given
+// offset of the outfile. The file offset is not used or changed, so several
+// threads can write different parts of the outfile at the same time. Stops
+// early only on an error. Returns the number of bytes written.
+int write_at(IO *io, int outfile, uint8_t *buf, int nbytes, uint64_t offset) {
+  int bytes_written_once = 0;
+  while (bytes_written_once < nbytes) {
+    ssize_t w = pwrite(outfile, &buf[bytes_written_once],
+                       nbytes - bytes_written_once,
+                       offset + bytes_written_once);
+    __atomic_fetch_add(&io->syscalls, 1, __ATOMIC_RELAXED);
+    // Try again if a signal interrupted the write
+    if (w < 0 && errno == EINTR) {
+      continue;
+    }
+    if (w <= 0) {
+      __atomic_store_n(&io->failed, true, __ATOMIC_RELAXED);
+      break;
+    }
+    bytes_written_once += w;
+  }
+  __atomic_fetch_add(&io->bytes_written, bytes_written_once, __ATOMIC_RELAXED);
   return bytes_written_once;
 }
 
-// Read a block of bytes to a static buffer variable, and return one bit of the
-// buffer at a time to the bit argument.
-bool read_bit(int infile, uint8_t *bit) {
+// Read a block of bytes to the input buffer of the IO, and return one bit of
+// the buffer at a time to the bit argument.
+bool read_bit(IO *io, int infile, uint8_t *bit) {
   //  All bits in the buffer have been doled out
-  if (index_byte == BLOCK) {
+  if (io->index_byte == io->block_size) {
     // Get a new block of character
-    int r = read_bytes(infile, buffer, BLOCK);
+    uint8_t *block;
+    int r = read_block(io, infile, &block);
     // If no characters were read, we are at the end of the file
     if (r <= 0) {
       return false;
     }
-    // reset index since we start from 0
-    index_byte = 0;
-    current_bit = 0;
   }
   // Get the current bit from the buffer and set it to the bit argument.
-  *bit = (buffer[index_byte] & ((1) << (current_bit))) >> current_bit;
-  current_bit += 1;
+  *bit = (io->current_block[io->index_byte] & ((1) << (io->current_bit))) >>
+         io->current_bit;
+  io->current_bit += 1;
   // Move to the next byte
-  if (current_bit > 7) {
-    current_bit = 0;
-    index_byte += 1;
+  if (io->current_bit > 7) {
+    io->current_bit = 0;
+    io->index_byte += 1;
   }
   return true;
 }
 
-// Write the contents of a code to the outfile, only if the number of bits will
-// be equal to a size of a BLOCK.
-void write_code(int outfile, Code *c) {
-  uint32_t current_index = 0;
-  // While it is not the end of the code
-  while (current_index < code_size(c)) {
-    // Get a new bit from the Code. Change it to a character instead of an int.
-    uint64_t byte = index_code / 8;
-    uint64_t bit = index_code % 8;
-    // Set the buffer to the value of the bit
-    if (code_get_bit(c, current_index) == true) {
-      buffer_code[byte] |= ((1UL) << (bit)); // Sets bit to 1
-    } else {
-      buffer_code[byte] &= ~((1UL) << (bit)); // Clears bit
-    }
-    current_index += 1;
-    index_code += 1;
-    // Write the bytes to a file, and if the bytes equal a full block, reset the
-    // index
-    if (index_code >= BLOCK * 8) {
-      write_bytes(outfile, buffer_code, BLOCK);
-      index_code = 0;
+// Moves the full 64-bit bit_buffer into buffer_code, and writes buffer_code
+// to the outfile once it holds a full BLOCK.
+static void write_word(IO *io, int outfile) {
+  uint64_t word = io->bit_buffer;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  memcpy(&io->buffer_code[io->index_code], &word, sizeof(word));
+  io->index_code += sizeof(word);
+  if (io->index_code == io->buffer_size) {
+    write_bytes(io, outfile, io->buffer_code, io->buffer_size);
+    io->index_code = 0;
+  }
+}
+
+// Adds the lowest length bits of the bits argument to the outfile, with the
+// lowest bit first. Length can be at most 64, and the bits above length must
+// be 0. The bits are collected in a 64-bit buffer and moved out a word at a
+// time.
+void write_bits(IO *io, int outfile, uint64_t bits, uint32_t length) {
+  // Add the new bits on top of the ones that are already in the buffer
+  if (io->bit_count < 64) {
+    io->bit_buffer |= bits << io->bit_count;
+  }
+  // The buffer is not full yet
+  if (io->bit_count + length < 64) {
+    io->bit_count += length;
+    return;
+  }
+  // The buffer is full: move it out, and keep the new bits that didn't fit
+  write_word(io, outfile);
+  io->bit_buffer = io->bit_count == 0 ? 0 : bits >> (64 - io->bit_count);
+  io->bit_count = io->bit_count + length - 64;
+}
+
+// Write the contents of a code to the outfile. The bits of the code are
+// already stored with the first bit in the lowest position, so they are added
+// 32 bits at a time instead of one bit at a time.
+void write_code(IO *io, int outfile, Code *c) {
+  for (uint32_t i = 0; i < code_size(c); i += 32) {
+    uint32_t length = code_size(c) - i < 32 ? code_size(c) - i : 32;
+    uint64_t bits = 0;
+    for (uint32_t j = 0; j < (length + 7) / 8; j += 1) {
+      bits |= (uint64_t)c->bits[i / 8 + j] << (8 * j);
     }
+    write_bits(io, outfile, bits & ((1ULL << length) - 1), length);
   }
 }
 
 // Write out any bits that are left over in the buffer after calling the
-// write_code function.
-void flush_codes(int outfile) {
-  // If the current bit is not divisible by 8, then we are in the middle of a
-  // byte. In this case, set the current bit to 0 and continue to increase the
-  // current bit until it's the end of the byte.
-  while (index_code % 8 != 0) {
-    buffer_code[index_code / 8] &= ~((1UL) << (index_code));
-    index_code += 1;
-  }
-  // Write the bytes to a file, and since the bytes equal to a full block, reset
-  // the index
-  write_bytes(outfile, buffer_code, (index_code / 8));
-  index_code = 0;
+// write_bits and write_code functions.
+void flush_codes(IO *io, int outfile) {
+  // Move out the whole bytes of the bit buffer. The last byte is padded with 0
+  // bits, since the bits above bit_count are always 0.
+  for (uint32_t i = 0; i < (io->bit_count + 7) / 8; i += 1) {
+    io->buffer_code[io->index_code] = io->bit_buffer >> (8 * i);
+    io->index_code += 1;
+  }
+  io->bit_buffer = 0;
+  io->bit_count = 0;
+  // Write the bytes to a file, and reset the index
+  write_bytes(io, outfile, io->buffer_code, io->index_code);
+  io->index_code = 0;
 }
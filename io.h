@@ -4,15 +4,47 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-extern uint64_t bytes_read;
-extern uint64_t bytes_written;
+typedef struct IO IO;
 
-int read_bytes(int infile, uint8_t *buf, int nbytes);
+IO *io_create(uint32_t buffer_size);
 
-int write_bytes(int outfile, uint8_t *buf, int nbytes);
+void io_delete(IO **io);
 
-bool read_bit(int infile, uint8_t *bit);
+uint32_t io_buffer_size(IO *io);
 
-void write_code(int outfile, Code *c);
+uint64_t io_bytes_read(IO *io);
 
-void flush_codes(int outfile);
+uint64_t io_bytes_written(IO *io);
+
+uint64_t io_syscalls(IO *io);
+
+bool io_failed(IO *io);
+
+int read_bytes(IO *io, int infile, uint8_t *buf, int nbytes);
+
+int write_bytes(IO *io, int outfile, uint8_t *buf, int nbytes);
+
+bool io_map(IO *io, int infile);
+
+int io_attach(IO *io, const uint8_t *src, uint64_t size);
+
+bool io_mapped(IO *io, int infile);
+
+void io_rewind(IO *io, int infile);
+
+int read_block(IO *io, int infile, uint8_t **block);
+
+int read_span(IO *io, int infile, uint8_t *buf, int nbytes, uint8_t **span);
+
+int read_span_at(IO *io, int infile, uint8_t *buf, int nbytes,
+                 uint64_t offset, uint8_t **span);
+
+int write_at(IO *io, int outfile, uint8_t *buf, int nbytes, uint64_t offset);
+
+bool read_bit(IO *io, int infile, uint8_t *bit);
+
+void write_bits(IO *io, int outfile, uint64_t bits, uint32_t length);
+
+void write_code(IO *io, int outfile, Code *c);
+
+void flush_codes(IO *io, int outfile);
@@ -0,0 +1,289 @@
+#include "libhuffman.h"
+#include "decoder.h"
+#include "defines.h"
+#include "frame.h"
+#include "header.h"
+#include "huffman.h"
+#include "io.h"
+#include "memstats.h"
+#include "node.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Goal: compress and decompress buffers in memory, so a program can use the
+// Huffman coder without running the encode and decode programs. All the state
+// of a call lives in a HuffmanContext, so there is no global state: each
+// thread can use its own context at the same time as the others. The
+// compressed buffers use the framed format, so they can also be decompressed
+// by the decode program, and the decompressor reads both formats. A range of
+// the decompressed bytes can be decompressed on its own, which only decodes
+// the frames that hold it, from the checkpoints nearest to it.
+
+// Defines what members/fields the HuffmanContext structure has.
+// Frame_size is the number of input bytes per frame, interval is the number
+// of bytes between the checkpoints of a frame (0 for none), and limit is the
+// longest code in bits (0 for no limit).
+// Buffer holds the output of the last call, size is the number of bytes in
+// it, and capacity is the number of bytes allocated for it. The buffer is
+// kept between calls, so a context that is used many times rarely allocates.
+struct HuffmanContext {
+  uint32_t frame_size;
+  uint32_t interval;
+  uint32_t limit;
+  uint8_t *buffer;
+  uint64_t size;
+  uint64_t capacity;
+};
+
+// The constructor for a HuffmanContext. A frame_size of 0 uses the default
+// FRAME_SIZE. Returns a pointer to the HuffmanContext if the memory was
+// allocated succesfully and the settings are valid. Else, return NULL.
+HuffmanContext *huffman_context_create(uint32_t frame_size, uint32_t interval,
+                                       uint32_t limit) {
+  if (frame_size == 0) {
+    frame_size = FRAME_SIZE;
+  }
+  if (frame_size > MAX_FRAME || limit > MAX_LIMIT) {
+    return NULL;
+  }
+  HuffmanContext *ctx = (HuffmanContext *)malloc(sizeof(HuffmanContext));
+  if (ctx) {
+    ctx->frame_size = frame_size;
+    ctx->interval = interval;
+    ctx->limit = limit;
+    ctx->buffer = NULL;
+    ctx->size = 0;
+    ctx->capacity = 0;
+  }
+  return ctx;
+}
+
+// The destructor for a HuffmanContext. Frees the output buffer and the
+// HuffmanContext, and set the pointer to NULL.
+void huffman_context_delete(HuffmanContext **ctx) {
+  if (*ctx) {
+    free((*ctx)->buffer);
+    (*ctx)->buffer = NULL;
+    free(*ctx);
+    *ctx = NULL;
+  }
+}
+
+// Makes room for n more bytes in the output buffer, at least doubling it when
+// it grows. The buffer is allocated even for 0 bytes, so an empty output is
+// not mistaken for an error. Returns true to indicate success, false
+// otherwise.
+static bool reserve(HuffmanContext *ctx, uint64_t n) {
+  if (ctx->buffer && n <= ctx->capacity - ctx->size) {
+    return true;
+  }
+  uint64_t capacity = ctx->capacity == 0 ? BLOCK : 2 * ctx->capacity;
+  if (capacity - ctx->size < n) {
+    capacity = ctx->size + n;
+  }
+  uint8_t *bigger = (uint8_t *)realloc(ctx->buffer, capacity);
+  if (!bigger) {
+    return false;
+  }
+  ctx->buffer = bigger;
+  ctx->capacity = capacity;
+  return true;
+}
+
+// Returns true if the bytes bytes of a bitstream can hold symbols symbols.
+// Every code is at least one bit long, so a size read from the caller's
+// buffer that needs more is invalid, and is rejected before anything that
+// large is allocated.
+static bool fits(uint64_t symbols, uint64_t bytes) {
+  return symbols / 8 <= bytes;
+}
+
+// Adds the n bytes of buf to the end of the output buffer. Returns true to
+// indicate success, false otherwise.
+static bool append(HuffmanContext *ctx, const void *buf, uint64_t n) {
+  if (!reserve(ctx, n)) {
+    return false;
+  }
+  memcpy(&ctx->buffer[ctx->size], buf, n);
+  ctx->size += n;
+  return true;
+}
+
+// Compresses the n bytes of src in the framed format: the header, a frame for
+// every frame_size bytes and an empty frame that marks the end. Sets size to
+// the number of compressed bytes. Returns the compressed bytes, which belong
+// to the context and are valid until its next call, or NULL if the memory
+// couldn't be allocated.
+uint8_t *huffman_compress(HuffmanContext *ctx, const uint8_t *src, uint64_t n,
+                          uint64_t *size) {
+  ctx->size = 0;
+  Header h = {MAGIC_FRAMED, 0, 0, n};
+  if (!append(ctx, &h, sizeof(Header))) {
+    return NULL;
+  }
+  for (uint64_t offset = 0; offset < n; offset += ctx->frame_size) {
+    uint32_t length =
+        n - offset < ctx->frame_size ? n - offset : ctx->frame_size;
+    uint8_t *frame;
+    uint64_t frame_size =
+        frame_encode(&src[offset], length, ctx->interval, ctx->limit, false,
+                     &frame);
+    bool ok = frame_size != 0 && append(ctx, frame, frame_size);
+    free(frame);
+    if (!ok) {
+      return NULL;
+    }
+  }
+  // An empty frame marks the end of the frames
+  Frame end = {0, 0, 0, 0};
+  if (!append(ctx, &end, sizeof(Frame))) {
+    return NULL;
+  }
+  *size = ctx->size;
+  return ctx->buffer;
+}
+
+// Decompresses the first symbols bytes of the single Huffman stream that
+// follows the header h, in the n bytes of src. Returns true to indicate
+// success, false otherwise.
+static bool decompress_single(HuffmanContext *ctx, Header *h,
+                              const uint8_t *src, uint64_t n,
+                              uint64_t symbols) {
+  uint64_t pos = sizeof(Header) + h->tree_size;
+  // The decoder reads at most 4 GB of bitstream from memory
+  if (h->tree_size > MAX_TREE_SIZE || pos > n || n - pos > UINT32_MAX ||
+      symbols > h->file_size || !fits(symbols, n - pos) ||
+      !reserve(ctx, symbols)) {
+    return false;
+  }
+  FlatTree t;
+  if (!rebuild_tree(h->tree_size, &src[sizeof(Header)], &t)) {
+    return false;
+  }
+  Decoder *d = decoder_create(&t);
+  if (!d) {
+    return false;
+  }
+  decoder_reset(d, &src[pos], n - pos);
+  bool ok = decoder_decode(d, NULL, -1, ctx->buffer, symbols) == symbols;
+  decoder_delete(&d);
+  ctx->size = symbols;
+  return ok;
+}
+
+// Decompresses the frames that follow the header, in the n bytes of src,
+// until reaching the empty frame that marks the end. Returns true to indicate
+// success, false otherwise.
+static bool decompress_frames(HuffmanContext *ctx, Header *h,
+                              const uint8_t *src, uint64_t n) {
+  uint64_t pos = sizeof(Header);
+  // The header has the size of the output when it was known in advance. It
+  // is only a hint, as the buffer grows with every frame anyway.
+  if (!reserve(ctx, fits(h->file_size, n - pos) ? h->file_size : 0)) {
+    return false;
+  }
+  // The decoder of the last frame with a code, for the frames that reuse it
+  Decoder *last = NULL;
+  bool ok = false;
+  Frame f;
+  while (n - pos >= sizeof(Frame)) {
+    memcpy(&f, &src[pos], sizeof(Frame));
+    pos += sizeof(Frame);
+    // An empty frame marks the end of the frames
+    if (f.symbols == 0) {
+      ok = true;
+      break;
+    }
+    uint64_t frame_size = (uint64_t)f.tree_size + f.payload_size;
+    if (frame_size > n - pos || !fits(f.symbols, f.payload_size) ||
+        !reserve(ctx, f.symbols) ||
+        !frame_decode_span(&f, &src[pos], &last, &ctx->buffer[ctx->size])) {
+      break;
+    }
+    ctx->size += f.symbols;
+    pos += frame_size;
+  }
+  decoder_delete(&last);
+  return ok;
+}
+
+// Decompresses the n bytes of src, which can be in the single-stream or in the
+// framed format. Sets size to the number of decompressed bytes. Returns the
+// decompressed bytes, which belong to the context and are valid until its next
+// call, or NULL if src is invalid or the memory couldn't be allocated.
+uint8_t *huffman_decompress(HuffmanContext *ctx, const uint8_t *src, uint64_t n,
+                            uint64_t *size) {
+  ctx->size = 0;
+  Header h;
+  if (n < sizeof(Header)) {
+    return NULL;
+  }
+  memcpy(&h, src, sizeof(Header));
+  bool ok = false;
+  if (h.magic == MAGIC) {
+    ok = decompress_single(ctx, &h, src, n, h.file_size);
+  } else if (h.magic == MAGIC_FRAMED) {
+    ok = decompress_frames(ctx, &h, src, n);
+  }
+  if (!ok) {
+    return NULL;
+  }
+  *size = ctx->size;
+  return ctx->buffer;
+}
+
+// Decompresses length bytes starting at the given offset of the decompressed
+// bytes of the n bytes of src, like huffman_decompress. Only the frames that
+// hold the range are decoded, each from its last checkpoint before the range
+// (see huffman_context_create's interval), and they are found with the seek
+// index when there is one. The single-stream format has no checkpoints, so it
+// is decoded from the start. A range past the end is cut short. Sets size to
+// the number of decompressed bytes. Returns them, which belong to the context
+// and are valid until its next call, or NULL if src is invalid or the memory
+// couldn't be allocated.
+uint8_t *huffman_decompress_range(HuffmanContext *ctx, const uint8_t *src,
+                                  uint64_t n, uint64_t offset,
+                                  uint64_t length, uint64_t *size) {
+  ctx->size = 0;
+  Header h;
+  if (n < sizeof(Header)) {
+    return NULL;
+  }
+  memcpy(&h, src, sizeof(Header));
+  bool ok = false;
+  if (h.magic == MAGIC) {
+    offset = offset < h.file_size ? offset : h.file_size;
+    length = length < h.file_size - offset ? length : h.file_size - offset;
+    // Decode up to the end of the range, and keep only the range
+    ok = decompress_single(ctx, &h, src, n, offset + length);
+    if (ok) {
+      memmove(ctx->buffer, &ctx->buffer[offset], length);
+      ctx->size = length;
+    }
+  } else if (h.magic == MAGIC_FRAMED) {
+    // The frames are read from src as if it were a mapped file
+    IO *io = io_create(BLOCK);
+    int infile = io ? io_attach(io, src, n) : -1;
+    uint32_t entries;
+    uint64_t symbols;
+    FrameEntry *index =
+        io ? frame_index(io, infile, n, &entries, &symbols) : NULL;
+    if (index && fits(symbols, n)) {
+      offset = offset < symbols ? offset : symbols;
+      length = length < symbols - offset ? length : symbols - offset;
+      ok = reserve(ctx, length) &&
+           frame_decode_range(io, infile, index, entries, symbols, offset,
+                              length, ctx->buffer) == length;
+      ctx->size = length;
+    }
+    free(index);
+    io_delete(&io);
+  }
+  if (!ok) {
+    return NULL;
+  }
+  *size = ctx->size;
+  return ctx->buffer;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The objects are built with -fvisibility=hidden, so the shared library only
+// exports the functions marked with HUFFMAN_EXPORT.
+#define HUFFMAN_EXPORT __attribute__((visibility("default")))
+
+typedef struct HuffmanContext HuffmanContext;
+
+HUFFMAN_EXPORT HuffmanContext *huffman_context_create(uint32_t frame_size,
+                                                      uint32_t interval,
+                                                      uint32_t limit);
+
+HUFFMAN_EXPORT void huffman_context_delete(HuffmanContext **ctx);
+
+HUFFMAN_EXPORT uint8_t *huffman_compress(HuffmanContext *ctx,
+                                         const uint8_t *src, uint64_t n,
+                                         uint64_t *size);
+
+HUFFMAN_EXPORT uint8_t *huffman_decompress(HuffmanContext *ctx,
+                                           const uint8_t *src, uint64_t n,
+                                           uint64_t *size);
+
+HUFFMAN_EXPORT uint8_t *huffman_decompress_range(HuffmanContext *ctx,
+                                                 const uint8_t *src,
+                                                 uint64_t n, uint64_t offset,
+                                                 uint64_t length,
+                                                 uint64_t *size);
@@ -0,0 +1,203 @@
+#define MEMSTATS_SELF
+#include "memstats.h"
+#include "defines.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Goal: show what the allocations of each module cost, such as the nodes of
+// a tree, the priority queue and the stack. Built with MEMSTATS, every file
+// that includes memstats.h allocates through these functions, which count the
+// blocks each file allocated and freed and the bytes it holds, and keep its
+// peak. Each block starts with a small prefix that records its size and the
+// file that allocated it, so a block freed elsewhere (a frame freed by the
+// encoder, say) is still taken off the right file. The counts are shared by
+// all threads and guarded by a mutex, as the counting build is only for
+// measuring.
+
+// Defines what members/fields the record of a file has.
+// File is its name, allocs and frees the number of its blocks that were
+// allocated and freed, live the bytes it holds now, and peak the most it held
+// at once.
+typedef struct {
+  const char *file;
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t live;
+  uint64_t peak;
+} Site;
+
+// The prefix of a block: its size and the index of its file's record. The
+// union keeps the block after it aligned for any type.
+typedef union {
+  struct {
+    uint64_t size;
+    uint32_t site;
+  } block;
+  max_align_t align;
+} Prefix;
+
+// The records of the files in the order of their first allocation, and the
+// record of them all together. Files that don't fit add to the total only.
+static Site sites[MAX_SITES];
+static uint32_t site_count = 0;
+static Site total = {"total", 0, 0, 0, 0};
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns true if the program was built to count its allocations.
+bool memstats_enabled(void) {
+#ifdef MEMSTATS
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Returns the index of the record of the file, and adds it if it's new.
+// Returns MAX_SITES if there is no room for it. The lock must be held.
+static uint32_t site(const char *file) {
+  for (uint32_t i = 0; i < site_count; i += 1) {
+    if (sites[i].file == file || strcmp(sites[i].file, file) == 0) {
+      return i;
+    }
+  }
+  if (site_count == MAX_SITES) {
+    return MAX_SITES;
+  }
+  sites[site_count].file = file;
+  site_count += 1;
+  return site_count - 1;
+}
+
+// Adds a change of allocs, frees and bytes to the record s, and updates its
+// peak.
+static void count(Site *s, uint64_t allocs, uint64_t frees, uint64_t added,
+                  uint64_t removed) {
+  s->allocs += allocs;
+  s->frees += frees;
+  s->live = s->live + added - removed;
+  if (s->live > s->peak) {
+    s->peak = s->live;
+  }
+}
+
+// Records an allocation, a free or a resize of a block of the site. Allocs
+// and frees are the blocks allocated and freed, and added and removed the
+// bytes. The lock must be held.
+static void record(uint32_t i, uint64_t allocs, uint64_t frees,
+                   uint64_t added, uint64_t removed) {
+  if (i < MAX_SITES) {
+    count(&sites[i], allocs, frees, added, removed);
+  }
+  count(&total, allocs, frees, added, removed);
+}
+
+// Fills in the prefix of a new block of size bytes allocated by the file, and
+// counts it. Returns the block after the prefix, or NULL if p is NULL.
+static void *allocated(const char *file, Prefix *p, uint64_t size) {
+  if (!p) {
+    return NULL;
+  }
+  pthread_mutex_lock(&lock);
+  p->block.size = size;
+  p->block.site = site(file);
+  record(p->block.site, 1, 0, size, 0);
+  pthread_mutex_unlock(&lock);
+  return p + 1;
+}
+
+// Counts malloc(size) made by the file.
+void *memstats_malloc(const char *file, size_t size) {
+  if (size > SIZE_MAX - sizeof(Prefix)) {
+    return NULL;
+  }
+  return allocated(file, (Prefix *)malloc(sizeof(Prefix) + size), size);
+}
+
+// Counts calloc(count, size) made by the file.
+void *memstats_calloc(const char *file, size_t count, size_t size) {
+  if (size > 0 && count > (SIZE_MAX - sizeof(Prefix)) / size) {
+    return NULL;
+  }
+  return allocated(file, (Prefix *)calloc(1, sizeof(Prefix) + count * size),
+                   count * size);
+}
+
+// Counts realloc(p, size) made by the file. Resizing a block isn't counted as
+// an allocation, only the change of its bytes, which stay with the file that
+// allocated it.
+void *memstats_realloc(const char *file, void *p, size_t size) {
+  if (!p) {
+    return memstats_malloc(file, size);
+  }
+  if (size > SIZE_MAX - sizeof(Prefix)) {
+    return NULL;
+  }
+  Prefix *old = (Prefix *)p - 1;
+  uint64_t before = old->block.size;
+  Prefix *q = (Prefix *)realloc(old, sizeof(Prefix) + size);
+  if (!q) {
+    return NULL;
+  }
+  pthread_mutex_lock(&lock);
+  q->block.size = size;
+  record(q->block.site, 0, 0, size, before);
+  pthread_mutex_unlock(&lock);
+  return q + 1;
+}
+
+// Counts free(p), and takes its bytes off the file that allocated it.
+void memstats_free(void *p) {
+  if (p) {
+    Prefix *block = (Prefix *)p - 1;
+    pthread_mutex_lock(&lock);
+    record(block->block.site, 0, 1, 0, block->block.size);
+    pthread_mutex_unlock(&lock);
+    free(block);
+  }
+}
+
+// Prints a table of the allocations, frees, peak bytes and live bytes of each
+// file that allocated, and of them all together, to the file f. Prints nothing
+// if the program wasn't built to count them.
+void memstats_print(FILE *f) {
+  if (!memstats_enabled()) {
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  fprintf(f, "%-14s %10s %10s %12s %12s\n", "File", "Allocs", "Frees",
+          "Peak bytes", "Live bytes");
+  for (uint32_t i = 0; i <= site_count; i += 1) {
+    Site *s = i < site_count ? &sites[i] : &total;
+    fprintf(f, "%-14s %10lu %10lu %12lu %12lu\n", s->file, s->allocs,
+            s->frees, s->peak, s->live);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+// Prints the allocations as a JSON object (the total, then each file) to the
+// file f, or null if the program wasn't built to count them.
+void memstats_print_json(FILE *f) {
+  if (!memstats_enabled()) {
+    fprintf(f, "null");
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  fprintf(f,
+          "{\"allocs\": %lu, \"frees\": %lu, \"peak_bytes\": %lu, "
+          "\"live_bytes\": %lu, \"files\": [",
+          total.allocs, total.frees, total.peak, total.live);
+  for (uint32_t i = 0; i < site_count; i += 1) {
+    fprintf(f,
+            "%s{\"file\": \"%s\", \"allocs\": %lu, \"frees\": %lu, "
+            "\"peak_bytes\": %lu, \"live_bytes\": %lu}",
+            i > 0 ? ", " : "", sites[i].file, sites[i].allocs, sites[i].frees,
+            sites[i].peak, sites[i].live);
+  }
+  fprintf(f, "]}");
+  pthread_mutex_unlock(&lock);
+}
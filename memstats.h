@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+bool memstats_enabled(void);
+
+void memstats_print(FILE *f);
+
+void memstats_print_json(FILE *f);
+
+void *memstats_malloc(const char *file, size_t size);
+
+void *memstats_calloc(const char *file, size_t count, size_t size);
+
+void *memstats_realloc(const char *file, void *p, size_t size);
+
+void memstats_free(void *p);
+
+// Built with -DMEMSTATS (make MEMSTATS=1), every file that includes this
+// header allocates and frees through the counting functions above, which
+// charge each block to the file that allocated it. A block must be freed by a
+// file that includes this header too. memstats.c itself uses the real ones.
+#if defined(MEMSTATS) && !defined(MEMSTATS_SELF)
+#define malloc(size) memstats_malloc(__FILE__, (size))
+#define calloc(count, size) memstats_calloc(__FILE__, (count), (size))
+#define realloc(p, size) memstats_realloc(__FILE__, (p), (size))
+#define free(p) memstats_free((p))
+#endif
@@ -0,0 +1,408 @@
+#include "arena.h"
+#include "code.h"
+#include "decoder.h"
+#include "defines.h"
+#include "huffman.h"
+#include "node.h"
+#include "pq.h"
+#include "stack.h"
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Goal: time the building blocks of the encoder and the decoder one at a
+// time, to see where the setup cost of a block goes. Each primitive is run on
+// a few histograms: a uniform one (a balanced tree), a random one, and one of
+// Fibonacci frequencies, which gives the deepest possible tree. A primitive is
+// first run with more and more iterations until a run takes at least
+// MIN_SECONDS, and then it is run that many iterations several more times.
+// The results are printed as CSV or JSON: the nanoseconds per operation of
+// the fastest and the median run.
+
+#define MIN_SECONDS 0.05    // Least seconds of a timed run.
+#define MAX_REPEATS 100     // Most timed runs of each primitive.
+#define FIB_SYMBOLS 90      // Symbols of the Fibonacci histogram.
+
+// Defines what members/fields the state of a primitive has.
+// Hist is the histogram, a holds the Nodes of its tree, leaves holds one leaf
+// per symbol of the histogram (from their own arena, leaf_arena) and count is
+// their number. Root is the root of the tree, table its codes, lengths their
+// lengths, dump the dump of the tree and dump_size its number of bytes. Sink
+// collects results, so the compiler can't throw the work away.
+typedef struct {
+  uint64_t hist[ALPHABET];
+  Arena *a;
+  Arena *leaf_arena;
+  Node *leaves[ALPHABET];
+  uint32_t count;
+  Node *root;
+  Code table[ALPHABET];
+  uint8_t lengths[ALPHABET];
+  uint8_t dump[MAX_TREE_SIZE];
+  uint16_t dump_size;
+  uint64_t sink;
+} State;
+
+// Defines what members/fields a primitive has.
+// Name names it, run runs it iterations times on the state s, and ops
+// returns the number of operations in one iteration (such as one enqueue and
+// one dequeue per symbol).
+typedef struct {
+  const char *name;
+  void (*run)(State *s, uint64_t iterations);
+  uint64_t (*ops)(State *s);
+} Primitive;
+
+// Enqueues every leaf, then dequeues them all.
+static void run_pq(State *s, uint64_t iterations) {
+  PriorityQueue *q = pq_create(ALPHABET);
+  for (uint64_t k = 0; k < iterations; k += 1) {
+    for (uint32_t i = 0; i < s->count; i += 1) {
+      enqueue(q, s->leaves[i]);
+    }
+    Node *n;
+    while (dequeue(q, &n)) {
+      s->sink += n->frequency;
+    }
+  }
+  pq_delete(&q);
+}
+
+// Pushes every leaf on a stack, then pops them all.
+static void run_stack(State *s, uint64_t iterations) {
+  Stack *st = stack_create(ALPHABET);
+  for (uint64_t k = 0; k < iterations; k += 1) {
+    for (uint32_t i = 0; i < s->count; i += 1) {
+      stack_push(st, s->leaves[i]);
+    }
+    Node *n;
+    while (stack_pop(st, &n)) {
+      s->sink += n->symbol;
+    }
+  }
+  stack_delete(&st);
+}
+
+// Pushes the bits of every symbol's code, then pops them, as build_codes does.
+static void run_code(State *s, uint64_t iterations) {
+  for (uint64_t k = 0; k < iterations; k += 1) {
+    for (uint32_t i = 0; i < ALPHABET; i += 1) {
+      Code c = code_init();
+      Code *code = &s->table[i];
+      for (uint32_t b = 0; b < code->top; b += 1) {
+        code_push_bit(&c, code_get_bit(code, b));
+      }
+      uint8_t bit;
+      while (code_pop_bit(&c, &bit)) {
+        s->sink += bit;
+      }
+    }
+  }
+}
+
+// Builds the tree of the histogram in the arena.
+static void run_build_tree(State *s, uint64_t iterations) {
+  for (uint64_t k = 0; k < iterations; k += 1) {
+    arena_reset(s->a);
+    s->root = build_tree(s->a, s->hist);
+    s->sink += s->root->frequency;
+  }
+}
+
+// Finds the code of every symbol from the tree.
+static void run_build_codes(State *s, uint64_t iterations) {
+  for (uint64_t k = 0; k < iterations; k += 1) {
+    build_codes(s->root, s->table);
+    s->sink += s->table[k % ALPHABET].top;
+  }
+}
+
+// Finds the length of every symbol's code without a tree of Nodes.
+static void run_build_lengths(State *s, uint64_t iterations) {
+  for (uint64_t k = 0; k < iterations; k += 1) {
+    build_lengths(s->hist, s->lengths);
+    s->sink += s->lengths[k % ALPHABET];
+  }
+}
+
+// Dumps the tree to memory.
+static void run_dump_tree(State *s, uint64_t iterations) {
+  for (uint64_t k = 0; k < iterations; k += 1) {
+    s->dump_size = dump_tree_buffer(s->root, s->dump);
+    s->sink += s->dump[k % s->dump_size];
+  }
+}
+
+// Rebuilds the dumped tree as a flat tree.
+static void run_rebuild_tree(State *s, uint64_t iterations) {
+  FlatTree t;
+  for (uint64_t k = 0; k < iterations; k += 1) {
+    rebuild_tree(s->dump_size, s->dump, &t);
+    s->sink += t.root;
+  }
+}
+
+// Builds the decoder of the code lengths, then deletes it.
+static void run_decoder(State *s, uint64_t iterations) {
+  for (uint64_t k = 0; k < iterations; k += 1) {
+    Decoder *d = decoder_create_lengths(s->lengths);
+    s->sink += d != NULL;
+    decoder_delete(&d);
+  }
+}
+
+// Returns two operations per leaf: a push and a pop (or an enqueue and a
+// dequeue).
+static uint64_t leaf_ops(State *s) {
+  return 2 * (uint64_t)s->count;
+}
+
+// Returns two operations per bit of every code: a push and a pop.
+static uint64_t bit_ops(State *s) {
+  uint64_t bits = 0;
+  for (uint32_t i = 0; i < ALPHABET; i += 1) {
+    bits += s->table[i].top;
+  }
+  return 2 * bits;
+}
+
+// Returns one operation per iteration.
+static uint64_t one_op(State *s) {
+  (void)s;
+  return 1;
+}
+
+static const Primitive primitives[] = {
+    {"pq", run_pq, leaf_ops},
+    {"stack", run_stack, leaf_ops},
+    {"code", run_code, bit_ops},
+    {"build_tree", run_build_tree, one_op},
+    {"build_codes", run_build_codes, one_op},
+    {"build_lengths", run_build_lengths, one_op},
+    {"dump_tree", run_dump_tree, one_op},
+    {"rebuild_tree", run_rebuild_tree, one_op},
+    {"decoder_create", run_decoder, one_op}};
+
+// Fills hist with the histogram named name: "uniform", "random" or
+// "fibonacci". Returns false for any other name.
+static bool fill_histogram(const char *name, uint64_t hist[static ALPHABET]) {
+  uint64_t state = 0x9E3779B97F4A7C15ULL;
+  for (uint32_t i = 0; i < ALPHABET; i += 1) {
+    hist[i] = 0;
+  }
+  if (strcmp(name, "uniform") == 0) {
+    for (uint32_t i = 0; i < ALPHABET; i += 1) {
+      hist[i] = 1000;
+    }
+  } else if (strcmp(name, "random") == 0) {
+    // xorshift64* from a fixed seed, so every run uses the same histogram
+    for (uint32_t i = 0; i < ALPHABET; i += 1) {
+      state ^= state >> 12;
+      state ^= state << 25;
+      state ^= state >> 27;
+      hist[i] = 1 + (state * 0x2545F4914F6CDD1DULL >> 40);
+    }
+  } else if (strcmp(name, "fibonacci") == 0) {
+    // Every frequency is the sum of the two below it, so each merge of the
+    // tree takes the tree so far and one more leaf
+    hist[0] = 1;
+    hist[1] = 1;
+    for (uint32_t i = 2; i < FIB_SYMBOLS; i += 1) {
+      hist[i] = hist[i - 1] + hist[i - 2];
+    }
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Sets up the state s for the histogram named name: its leaves, tree, codes,
+// code lengths and dump. Returns false if the name is unknown or the memory
+// couldn't be allocated.
+static bool state_init(State *s, const char *name) {
+  memset(s, 0, sizeof(State));
+  if (!fill_histogram(name, s->hist)) {
+    return false;
+  }
+  // The leaves live in their own arena, so run_build_tree can reset s->a
+  s->a = arena_create();
+  s->leaf_arena = arena_create();
+  if (!s->a || !s->leaf_arena) {
+    arena_delete(&s->a);
+    arena_delete(&s->leaf_arena);
+    return false;
+  }
+  for (uint32_t i = 0; i < ALPHABET; i += 1) {
+    if (s->hist[i] != 0) {
+      s->leaves[s->count] = arena_node(s->leaf_arena, i, s->hist[i]);
+      s->count += 1;
+    }
+  }
+  s->root = build_tree(s->a, s->hist);
+  build_codes(s->root, s->table);
+  build_lengths(s->hist, s->lengths);
+  s->dump_size = dump_tree_buffer(s->root, s->dump);
+  return true;
+}
+
+// Frees the arenas of the state s.
+static void state_free(State *s) {
+  arena_delete(&s->a);
+  arena_delete(&s->leaf_arena);
+}
+
+// Returns the seconds it takes to run the primitive p iterations times on s.
+static double time_run(const Primitive *p, State *s, uint64_t iterations) {
+  struct timespec start;
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  p->run(s, iterations);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// Compares two doubles for qsort.
+static int compare(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Function to print the help message
+void print_error(void) {
+  fprintf(stderr, "SYNOPSIS\n");
+  fprintf(stderr, "  Times the building blocks of the Huffman coder one at a time.\n\n");
+
+  fprintf(stderr, "USAGE\n");
+  fprintf(stderr, "  ./microbench [-h] [-r repeats] [-f csv|json] [-H histogram]\n\n");
+
+  fprintf(stderr, "OPTIONS\n");
+  fprintf(stderr, "  -h             Program usage and help.\n");
+  fprintf(stderr, "  -r repeats     Timed runs of each primitive (default: 5).\n");
+  fprintf(stderr, "  -f format      Print the results as csv or json (default: csv).\n");
+  fprintf(stderr, "  -H histogram   Only use the uniform, random or fibonacci\n");
+  fprintf(stderr, "                 histogram (default: all of them).\n");
+}
+
+int main(int argc, char **argv) {
+  int opt = 0; // used for getopt
+  // set default numbers
+  uint32_t repeats = 5;
+  bool json = false;
+  const char *histograms[] = {"uniform", "random", "fibonacci"};
+  uint32_t first_histogram = 0;
+  uint32_t histogram_count = 3;
+
+  while ((opt = getopt(argc, argv, "hr:f:H:")) != -1) {
+    switch (opt) {
+    // sets the number of timed runs of each primitive
+    case 'r':
+      repeats = strtoul(optarg, NULL, 10);
+      if (repeats == 0 || repeats > MAX_REPEATS) {
+        print_error();
+        return 1;
+      }
+      break;
+    // sets the format of the results
+    case 'f':
+      if (strcmp(optarg, "csv") != 0 && strcmp(optarg, "json") != 0) {
+        print_error();
+        return 1;
+      }
+      json = strcmp(optarg, "json") == 0;
+      break;
+    // only uses one histogram
+    case 'H':
+      histogram_count = 0;
+      for (uint32_t i = 0; i < 3; i += 1) {
+        if (strcmp(optarg, histograms[i]) == 0) {
+          first_histogram = i;
+          histogram_count = 1;
+        }
+      }
+      if (histogram_count == 0) {
+        print_error();
+        return 1;
+      }
+      break;
+    // usage message
+    case 'h':
+      print_error();
+      return 0;
+    // if it's not in the above options, return an error number
+    default:
+      print_error();
+      return 1;
+    }
+  }
+
+  if (json) {
+    printf("[\n");
+  } else {
+    printf("primitive,histogram,ops_per_iteration,iterations,min_ns_per_op,"
+           "median_ns_per_op\n");
+  }
+  bool first = true;
+  uint64_t sink = 0;
+  State *s = (State *)malloc(sizeof(State));
+  if (!s) {
+    fprintf(stderr, "Couldn't allocate the benchmark state\n");
+    return 1;
+  }
+  for (uint32_t h = first_histogram; h < first_histogram + histogram_count;
+       h += 1) {
+    if (!state_init(s, histograms[h])) {
+      fprintf(stderr, "Couldn't set up the %s histogram\n", histograms[h]);
+      free(s);
+      return 1;
+    }
+    uint64_t count = sizeof(primitives) / sizeof(primitives[0]);
+    for (uint64_t p = 0; p < count; p += 1) {
+      const Primitive *prim = &primitives[p];
+      // Double the iterations until a run is long enough to time
+      uint64_t iterations = 1;
+      while (time_run(prim, s, iterations) < MIN_SECONDS &&
+             iterations < (1ULL << 40)) {
+        iterations = 2 * iterations;
+      }
+      double times[MAX_REPEATS];
+      for (uint32_t r = 0; r < repeats; r += 1) {
+        times[r] = time_run(prim, s, iterations);
+      }
+      qsort(times, repeats, sizeof(double), compare);
+      double median = repeats % 2 == 1
+                          ? times[repeats / 2]
+                          : (times[repeats / 2 - 1] + times[repeats / 2]) / 2;
+      double ops = (double)iterations * prim->ops(s);
+      double min_ns = times[0] * 1e9 / ops;
+      double median_ns = median * 1e9 / ops;
+      if (json) {
+        printf("%s  {\"primitive\": \"%s\", \"histogram\": \"%s\", "
+               "\"ops_per_iteration\": %" PRIu64 ", \"iterations\": %" PRIu64
+               ", \"min_ns_per_op\": %.2f, \"median_ns_per_op\": %.2f}",
+               first ? "" : ",\n", prim->name, histograms[h], prim->ops(s),
+               iterations, min_ns, median_ns);
+      } else {
+        printf("%s,%s,%" PRIu64 ",%" PRIu64 ",%.2f,%.2f\n", prim->name,
+               histograms[h], prim->ops(s), iterations, min_ns, median_ns);
+      }
+      first = false;
+    }
+    sink += s->sink;
+    state_free(s);
+  }
+  if (json) {
+    printf("\n]\n");
+  }
+  free(s);
+  // Print the sink where no one looks, so the work can't be thrown away
+  if (sink == 42) {
+    fprintf(stderr, "\n");
+  }
+  return 0;
+}
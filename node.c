@@ -1,4 +1,5 @@
 #include "node.h"
+#include "memstats.h"
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "defines.h"
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -12,6 +13,17 @@ struct Node {
     uint64_t frequency;
 };
 
+// A Huffman tree for decoding, without pointers or frequencies. Child holds
+// the left and right child of each interior node, and root is the root. A
+// child (or the root) with the FLAT_LEAF bit set is a leaf whose symbol is in
+// the low byte, else it is the index of an interior node in child. Size is the
+// number of interior nodes.
+typedef struct {
+    uint16_t root;
+    uint16_t size;
+    uint16_t child[ALPHABET - 1][2];
+} FlatTree;
+
 Node *node_create(uint8_t symbol, uint64_t frequency);
 
 void node_delete(Node **n);
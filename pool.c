@@ -0,0 +1,144 @@
+#include "pool.h"
+#include "memstats.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Goal: a pool of worker threads that run the same task on many items, such
+// as encoding each frame of a batch. The threads are created once and wait
+// for work between calls to pool_run, and the thread that calls pool_run
+// works on the items too.
+
+// Defines what members/fields the Pool structure has.
+// Threads is the number of threads that work on a run, including the caller
+// of pool_run, and workers holds the threads-1 worker threads.
+// Lock protects all the members below it. Start is signaled when a new run
+// begins or the pool is deleted, and done is signaled when a run ends.
+// Task and arg are the task of the current run, count is its number of items,
+// next is the next item to hand out and finished is the number of items done.
+// Run counts the runs, so a worker knows when a new one begins.
+// Stop tells the workers to exit.
+struct Pool {
+  uint32_t threads;
+  pthread_t *workers;
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  Task *task;
+  void *arg;
+  uint32_t count;
+  uint32_t next;
+  uint32_t finished;
+  uint64_t run;
+  bool stop;
+};
+
+// Runs items of the current run until there are none left to hand out. Must
+// be called with the lock held, and returns with the lock held.
+static void work(Pool *p) {
+  while (p->next < p->count) {
+    uint32_t i = p->next;
+    p->next += 1;
+    pthread_mutex_unlock(&p->lock);
+    p->task(p->arg, i);
+    pthread_mutex_lock(&p->lock);
+    p->finished += 1;
+    if (p->finished == p->count) {
+      pthread_cond_signal(&p->done);
+    }
+  }
+}
+
+// The loop of a worker thread: wait for a run to begin and help with it.
+static void *worker(void *arg) {
+  Pool *p = (Pool *)arg;
+  uint64_t seen = 0;
+  pthread_mutex_lock(&p->lock);
+  while (true) {
+    while (!p->stop && p->run == seen) {
+      pthread_cond_wait(&p->start, &p->lock);
+    }
+    if (p->stop) {
+      break;
+    }
+    seen = p->run;
+    work(p);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+// The constructor for a Pool. Creates threads-1 worker threads and returns a
+// pointer to the Pool if the memory was allocated and the threads were started
+// succesfully. Else, return NULL.
+Pool *pool_create(uint32_t threads) {
+  if (threads == 0) {
+    return NULL;
+  }
+  Pool *p = (Pool *)calloc(1, sizeof(Pool));
+  if (!p) {
+    return NULL;
+  }
+  p->workers = (pthread_t *)calloc(threads, sizeof(pthread_t));
+  if (!p->workers) {
+    free(p);
+    return NULL;
+  }
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->start, NULL);
+  pthread_cond_init(&p->done, NULL);
+  // Start the workers. If a thread can't be started, the pool works with the
+  // threads it has.
+  p->threads = 1;
+  for (uint32_t i = 0; i + 1 < threads; i += 1) {
+    if (pthread_create(&p->workers[i], NULL, worker, p) != 0) {
+      break;
+    }
+    p->threads += 1;
+  }
+  return p;
+}
+
+// The destructor for a Pool. Stops and joins the worker threads, frees the
+// Pool, and set the pointer to NULL.
+void pool_delete(Pool **p) {
+  if (*p) {
+    pthread_mutex_lock(&(*p)->lock);
+    (*p)->stop = true;
+    pthread_cond_broadcast(&(*p)->start);
+    pthread_mutex_unlock(&(*p)->lock);
+    for (uint32_t i = 0; i + 1 < (*p)->threads; i += 1) {
+      pthread_join((*p)->workers[i], NULL);
+    }
+    pthread_mutex_destroy(&(*p)->lock);
+    pthread_cond_destroy(&(*p)->start);
+    pthread_cond_destroy(&(*p)->done);
+    free((*p)->workers);
+    free(*p);
+    *p = NULL;
+  }
+}
+
+// Returns the number of threads that work on a run, including the caller.
+uint32_t pool_threads(Pool *p) { return p->threads; }
+
+// Runs task(arg, i) for every i from 0 to count-1 on the threads of the pool,
+// and returns once all of them are done. The items may run in any order.
+void pool_run(Pool *p, Task *task, void *arg, uint32_t count) {
+  pthread_mutex_lock(&p->lock);
+  p->task = task;
+  p->arg = arg;
+  p->count = count;
+  p->next = 0;
+  p->finished = 0;
+  p->run += 1;
+  pthread_cond_broadcast(&p->start);
+  // The caller works on the items too, and then waits for the workers
+  work(p);
+  while (p->finished < p->count) {
+    pthread_cond_wait(&p->done, &p->lock);
+  }
+  pthread_mutex_unlock(&p->lock);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef struct Pool Pool;
+
+typedef void Task(void *arg, uint32_t i);
+
+Pool *pool_create(uint32_t threads);
+
+void pool_delete(Pool **p);
+
+uint32_t pool_threads(Pool *p);
+
+void pool_run(Pool *p, Task *task, void *arg, uint32_t count);
@@ -1,4 +1,5 @@
 #include "pq.h"
+#include "memstats.h"
 #include "node.h"
 #include <stdbool.h>
 #include <stdint.h>
@@ -6,10 +7,11 @@
 #include <stdlib.h>
 
 // Goal: a queue where each element has a priority, so elements with higher
-// priority will dequeue earlier. In my implementation, I used insertion sort
-// and put the nodes with highest freqeuncies at the end of an array. That way,
-// when dequeueing a node, all we need to do is to decrease the size of the
-// array without changing the positions of the other nodes.
+// priority will dequeue earlier. The node with the lowest frequency has the
+// highest priority. The nodes are kept in a binary min-heap: the children of
+// the node at index i are at indices 2i+1 and 2i+2, and no node has a higher
+// frequency than its children. That way, both enqueueing and dequeueing a
+// node take O(log n) swaps instead of the O(n) of a sorted array.
 
 // Defines what members/fields the Stack structure has.
 // Size represents the number of elements currently in the queue.
@@ -90,67 +92,51 @@ uint32_t pq_size(PriorityQueue *q) { return (q->size); }
 // false otherwise.
 bool enqueue(PriorityQueue *q, Node *n) {
   // Ensures that the queue exists and it's not full
-  if (q && n) {
-    if (!pq_full(q)) {
-      // Special case: the queue is empty.
-      // Adds the node at location 0 and increase the size of the queue
-      if (q->size == 0) {
-        q->items[0] = n;
-        q->size += 1;
-        return true;
-      }
-      // If the queue has at least one element
-      else {
-        // Set the new element at the end of the queue
-        q->items[q->size] = n;
-        // Goes through all elements of the queue
-        for (uint32_t i = 0; i < q->size; i += 1) {
-          // If the current element is smaller than the next element
-          // Swap them
-          if (node_cmp(q->items[i], q->items[i + 1]) == 0) {
-            // swap
-            Node *temp = q->items[i + 1];
-            q->items[i + 1] = q->items[i];
-            q->items[i] = temp;
-            // Sorts the left side of the array after the swap
-            for (uint32_t j = i; j > 0; j -= 1) {
-              // If the current element is bigger than the previous one, swap
-              // them
-              if (node_cmp(q->items[j], q->items[j - 1]) == 1) {
-                Node *temp = q->items[j - 1];
-                q->items[j - 1] = q->items[j];
-                q->items[j] = temp;
-              } else {
-                break;
-              }
-            }
-          }
-        }
-        q->size += 1;
-        return true;
-      }
-    }
+  if (!q || !n || pq_full(q)) {
+    return false;
   }
-  return false;
+  // Add the node at the end of the heap, and move it up while its parent has
+  // a higher frequency
+  uint32_t i = q->size;
+  while (i > 0 && node_cmp(q->items[(i - 1) / 2], n)) {
+    q->items[i] = q->items[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  q->items[i] = n;
+  q->size += 1;
+  return true;
 }
 
-// Dequeues a node from the PriorityQueue. Returns true to indicate success,
-// false otherwise.
+// Dequeues the node with the lowest frequency from the PriorityQueue. Returns
+// true to indicate success, false otherwise.
 bool dequeue(PriorityQueue *q, Node **n) {
-  // Takes the item at the end of the PriorityQueue and inserts it into the
-  // argument n Decreases the size of the queue by 1
-  if (q) {
-    if (!pq_empty(q)) {
-      *n = q->items[q->size - 1];
-      q->size -= 1;
-      return true;
-    }
+  if (!q || pq_empty(q)) {
     return false;
   }
-  return false;
+  // The root of the heap has the lowest frequency. The last node takes its
+  // place, and moves down while one of its children has a lower frequency.
+  *n = q->items[0];
+  q->size -= 1;
+  Node *last = q->items[q->size];
+  uint32_t i = 0;
+  while (2 * i + 1 < q->size) {
+    uint32_t child = 2 * i + 1;
+    if (child + 1 < q->size &&
+        node_cmp(q->items[child], q->items[child + 1])) {
+      child += 1;
+    }
+    if (!node_cmp(last, q->items[child])) {
+      break;
+    }
+    q->items[i] = q->items[child];
+    i = child;
+  }
+  q->items[i] = last;
+  return true;
 }
 
-// A debug function that prints all characteristics of the PriorityQueue.
+// A debug function that prints all characteristics of the PriorityQueue. The
+// nodes are printed in the order of the heap.
 void pq_print(PriorityQueue *q) {
   printf("Size: %u, Capacity: %u\n", q->size, q->capacity);
   // Go over all nodes in the item list and prints them.
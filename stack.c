@@ -1,3 +1,4 @@
+#include "memstats.h"
 #include "node.h"
 #include <stdbool.h>
 #include <stdint.h>
@@ -0,0 +1,330 @@
+#include "stats.h"
+#include "defines.h"
+#include "io.h"
+#include "memstats.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+// Goal: break the time of a run of the encoder or the decoder down into its
+// phases, so it shows whether a run waits on I/O or on the CPU. Each phase is
+// timed with a monotonic clock between stats_start and stats_stop, which also
+// count the read and write system calls made with the IO in between and the
+// bytes the phase handled. A phase can run many times (once per frame, say),
+// and its times add up. Only the thread that runs the phases may call them.
+// If stats_counters opened the hardware counters (Linux perf events), each
+// phase also counts the cycles, instructions, branch misses, L1 data cache
+// read misses and last level cache misses of the calling thread, which give
+// its instructions per cycle and misses per byte. Counters that the kernel
+// (or a container) doesn't allow are left out, and the rest still work.
+// The output ends with the peak resident memory of the process, and the
+// allocations of each file when it was built with MEMSTATS (see memstats.c).
+// The phases are:
+//   read      - reading the input, when it isn't part of another phase
+//   histogram - counting the input's bytes (the framed format also finds each
+//               frame's code lengths)
+//   tree      - building the Huffman tree, or the decode table from it
+//   codes     - building the code table from the tree
+//   header    - writing (or reading) the header and the tree dump
+//   encode    - writing the code of every input byte
+//   decode    - decoding the payload and writing the decoded bytes
+//   write     - writing whole frames, the end frame and the seek index
+//   flush     - writing the last bits and the end of the output
+
+static const char *names[PHASES] = {"read",   "histogram", "tree",
+                                    "codes",  "header",    "encode",
+                                    "decode", "write",     "flush"};
+
+// The hardware counters, in the order of their values in a PhaseStats
+enum { CYCLES, INSTRUCTIONS, BRANCH_MISSES, L1_MISSES, LLC_MISSES, COUNTERS };
+
+static const char *counter_names[COUNTERS] = {
+    "cycles", "instructions", "branch_misses", "l1d_misses", "llc_misses"};
+
+// Defines what members/fields the record of a phase has.
+// Runs is the number of times the phase ran, seconds their total time, bytes
+// the bytes they handled, syscalls the system calls they made and counts the
+// hardware counters. Started, started_syscalls and started_counts are the
+// clock, the system calls and the counters when the phase last started.
+typedef struct {
+  uint64_t runs;
+  double seconds;
+  uint64_t bytes;
+  uint64_t syscalls;
+  uint64_t counts[COUNTERS];
+  double started;
+  uint64_t started_syscalls;
+  uint64_t started_counts[COUNTERS];
+} PhaseStats;
+
+// Defines what members/fields the Stats structure has.
+// Created is the clock when the Stats was created, and phases holds the
+// record of each phase. Fds holds the file descriptor of each hardware
+// counter, or -1 if it isn't open, and counting is set if any of them is.
+struct Stats {
+  double created;
+  PhaseStats phases[PHASES];
+  int fds[COUNTERS];
+  bool counting;
+};
+
+// Returns the seconds of the monotonic clock.
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// The constructor for a Stats. Starts the clock of the whole run. Returns a
+// pointer to the Stats if the memory was allocated succesfully. Else, return
+// NULL.
+Stats *stats_create(void) {
+  Stats *s = (Stats *)calloc(1, sizeof(Stats));
+  if (s) {
+    s->created = now();
+    for (uint32_t c = 0; c < COUNTERS; c += 1) {
+      s->fds[c] = -1;
+    }
+  }
+  return s;
+}
+
+// The destructor for a Stats. Closes the hardware counters, frees the Stats
+// and set the pointer to NULL.
+void stats_delete(Stats **s) {
+  if (*s) {
+    for (uint32_t c = 0; c < COUNTERS; c += 1) {
+      if ((*s)->fds[c] >= 0) {
+        close((*s)->fds[c]);
+      }
+    }
+    free(*s);
+    *s = NULL;
+  }
+}
+
+// Opens the hardware counters of the calling thread, so every phase from now
+// on counts them too. Only user space is counted, which most systems allow
+// without privileges. Returns true if at least one counter could be opened,
+// false if none could (no perf events, or not allowed, as in many containers).
+bool stats_counters(Stats *s) {
+#ifdef __linux__
+  static const uint32_t types[COUNTERS] = {
+      PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+      PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE};
+  static const uint64_t configs[COUNTERS] = {
+      PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_BRANCH_MISSES,
+      PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+      PERF_COUNT_HW_CACHE_MISSES};
+  for (uint32_t c = 0; c < COUNTERS; c += 1) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = types[c];
+    attr.config = configs[c];
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // The counters may share the hardware with other events, so they also
+    // report how long they really counted
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    s->fds[c] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    s->counting = s->counting || s->fds[c] >= 0;
+  }
+#endif
+  return s->counting;
+}
+
+// Reads the hardware counters to counts. A counter that shared the hardware
+// is scaled up to the whole time it was enabled, and one that isn't open
+// reads 0.
+static void read_counters(Stats *s, uint64_t counts[static COUNTERS]) {
+  for (uint32_t c = 0; c < COUNTERS; c += 1) {
+    // The value, the time enabled and the time running
+    uint64_t v[3] = {0, 0, 0};
+    counts[c] = 0;
+    if (s->fds[c] >= 0 && read(s->fds[c], v, sizeof(v)) == sizeof(v)) {
+      counts[c] = v[2] > 0 && v[2] < v[1]
+                      ? (uint64_t)((double)v[0] * v[1] / v[2])
+                      : v[0];
+    }
+  }
+}
+
+// Starts the phase p, whose system calls are made with the io. Does nothing if
+// s is NULL, so the callers don't have to check if statistics were asked for.
+void stats_start(Stats *s, IO *io, Phase p) {
+  if (s) {
+    s->phases[p].started_syscalls = io_syscalls(io);
+    if (s->counting) {
+      read_counters(s, s->phases[p].started_counts);
+    }
+    s->phases[p].started = now();
+  }
+}
+
+// Stops the phase p, which handled the given number of bytes, and adds its
+// time and system calls to its record. Does nothing if s is NULL.
+void stats_stop(Stats *s, IO *io, Phase p, uint64_t bytes) {
+  if (s) {
+    PhaseStats *ps = &s->phases[p];
+    ps->seconds += now() - ps->started;
+    if (s->counting) {
+      uint64_t counts[COUNTERS];
+      read_counters(s, counts);
+      for (uint32_t c = 0; c < COUNTERS; c += 1) {
+        ps->counts[c] += counts[c] - ps->started_counts[c];
+      }
+    }
+    ps->syscalls += io_syscalls(io) - ps->started_syscalls;
+    ps->bytes += bytes;
+    ps->runs += 1;
+  }
+}
+
+// Returns the peak resident memory of the process so far, in KB.
+static uint64_t peak_rss(void) {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+  return usage.ru_maxrss;
+}
+
+// Returns true if the phase ran long enough for its MB/s to mean anything.
+// Shorter phases are mostly clock resolution and call overhead, so their MB/s
+// is printed as - (null in JSON).
+static bool timed(PhaseStats *ps) {
+  return ps->seconds >= MIN_PHASE_SECONDS;
+}
+
+// Returns the MB/s of a phase, or 0 if it didn't run long enough (see timed).
+static double throughput(PhaseStats *ps) {
+  return timed(ps) ? ps->bytes / ps->seconds / (1 << 20) : 0;
+}
+
+// Returns the count of the counter c per byte the phase handled, or 0 if it
+// handled none.
+static double per_byte(PhaseStats *ps, uint32_t c) {
+  return ps->bytes > 0 ? ps->counts[c] / (double)ps->bytes : 0;
+}
+
+// Returns the instructions per cycle of a phase, or 0 if it took no cycles.
+static double ipc(PhaseStats *ps) {
+  return ps->counts[CYCLES] > 0
+             ? ps->counts[INSTRUCTIONS] / (double)ps->counts[CYCLES]
+             : 0;
+}
+
+// Prints the memory the run used to the file f.
+static void print_memory(FILE *f) {
+  fprintf(f, "Peak RSS: %lu KB\n", peak_rss());
+  memstats_print(f);
+}
+
+// Prints a table of the phases that ran to the file f: their time, the share
+// of the whole run, MB/s and system calls. If the hardware counters are open,
+// a second table gives the cycles and instructions of each phase, their
+// instructions per cycle and the misses per byte the phase handled. Then
+// prints the peak resident memory, and the allocations of each file if they
+// were counted.
+void stats_print(Stats *s, FILE *f) {
+  double total = now() - s->created;
+  fprintf(f, "Total time: %.6lf s\n", total);
+  fprintf(f, "%-10s %12s %7s %10s %10s\n", "Phase", "Seconds", "Share",
+          "MB/s", "Syscalls");
+  for (uint32_t p = 0; p < PHASES; p += 1) {
+    PhaseStats *ps = &s->phases[p];
+    if (ps->runs == 0) {
+      continue;
+    }
+    fprintf(f, "%-10s %12.6lf %6.1lf%% ", names[p], ps->seconds,
+            total > 0 ? 100 * ps->seconds / total : 0);
+    if (timed(ps)) {
+      fprintf(f, "%10.1lf", throughput(ps));
+    } else {
+      fprintf(f, "%10s", "-");
+    }
+    fprintf(f, " %10lu\n", ps->syscalls);
+  }
+  if (s->counting) {
+    fprintf(f, "%-10s %14s %14s %6s %10s %10s %10s\n", "Phase", "Cycles",
+            "Instructions", "IPC", "Br.miss/B", "L1miss/B", "LLCmiss/B");
+    for (uint32_t p = 0; p < PHASES; p += 1) {
+      PhaseStats *ps = &s->phases[p];
+      if (ps->runs == 0) {
+        continue;
+      }
+      fprintf(f, "%-10s %14lu %14lu %6.2lf %10.4lf %10.4lf %10.4lf\n",
+              names[p], ps->counts[CYCLES], ps->counts[INSTRUCTIONS],
+              ipc(ps), per_byte(ps, BRANCH_MISSES), per_byte(ps, L1_MISSES),
+              per_byte(ps, LLC_MISSES));
+    }
+  }
+  print_memory(f);
+}
+
+
+// Prints the sizes, the total time, the phases that ran and the memory used
+// to the file f as a single JSON object, for tools to read. The allocations
+// are null unless they were counted.
+void stats_print_json(Stats *s, FILE *f, uint64_t uncompressed,
+                      uint64_t compressed) {
+  double total = now() - s->created;
+  double saving =
+      uncompressed > 0 ? 100 * (1 - compressed / (double)uncompressed) : 0;
+  fprintf(f,
+          "{\"uncompressed_bytes\": %lu, \"compressed_bytes\": %lu, "
+          "\"space_saving\": %.2lf, \"seconds\": %.6lf, \"phases\": [",
+          uncompressed, compressed, saving, total);
+  bool first = true;
+  for (uint32_t p = 0; p < PHASES; p += 1) {
+    PhaseStats *ps = &s->phases[p];
+    if (ps->runs == 0) {
+      continue;
+    }
+    fprintf(f,
+            "%s{\"name\": \"%s\", \"runs\": %lu, \"seconds\": %.6lf, "
+            "\"bytes\": %lu, \"mb_s\": ",
+            first ? "" : ", ", names[p], ps->runs, ps->seconds, ps->bytes);
+    if (timed(ps)) {
+      fprintf(f, "%.1lf", throughput(ps));
+    } else {
+      fprintf(f, "null");
+    }
+    fprintf(f, ", \"syscalls\": %lu", ps->syscalls);
+    // The counters that are open, then the ratios made from them
+    if (s->counting) {
+      for (uint32_t c = 0; c < COUNTERS; c += 1) {
+        if (s->fds[c] >= 0) {
+          fprintf(f, ", \"%s\": %lu", counter_names[c], ps->counts[c]);
+        }
+      }
+      if (s->fds[CYCLES] >= 0 && s->fds[INSTRUCTIONS] >= 0) {
+        fprintf(f, ", \"ipc\": %.3lf", ipc(ps));
+      }
+      for (uint32_t c = BRANCH_MISSES; c < COUNTERS; c += 1) {
+        if (s->fds[c] >= 0) {
+          fprintf(f, ", \"%s_per_byte\": %.6lf", counter_names[c],
+                  per_byte(ps, c));
+        }
+      }
+    }
+    fprintf(f, "}");
+    first = false;
+  }
+  fprintf(f, "], \"peak_rss_kb\": %lu, \"allocations\": ", peak_rss());
+  memstats_print_json(f);
+  fprintf(f, "}\n");
+}
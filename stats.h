@@ -0,0 +1,36 @@
+#pragma once
+
+#include "io.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum {
+    PHASE_READ,
+    PHASE_HISTOGRAM,
+    PHASE_TREE,
+    PHASE_CODES,
+    PHASE_HEADER,
+    PHASE_ENCODE,
+    PHASE_DECODE,
+    PHASE_WRITE,
+    PHASE_FLUSH,
+    PHASES
+} Phase;
+
+typedef struct Stats Stats;
+
+Stats *stats_create(void);
+
+void stats_delete(Stats **s);
+
+bool stats_counters(Stats *s);
+
+void stats_start(Stats *s, IO *io, Phase p);
+
+void stats_stop(Stats *s, IO *io, Phase p, uint64_t bytes);
+
+void stats_print(Stats *s, FILE *f);
+
+void stats_print_json(Stats *s, FILE *f, uint64_t uncompressed,
+                      uint64_t compressed);